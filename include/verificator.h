@@ -1,3 +1,28 @@
+#if defined(POSIX_BUILD) && !defined(__user)
+#define __user
+#endif
+
+/*
+ * Digest used for a region. CRC16 is the legacy default, CRC32C is the
+ * standard Castagnoli CRC (~0 seed and final xor), XXH64 uses seed 0.
+ */
+enum verificator_hash_algo {
+	VERIFICATOR_HASH_CRC16 	= 0,
+	VERIFICATOR_HASH_CRC32C = 1,
+	VERIFICATOR_HASH_XXH64 	= 2,
+	VERIFICATOR_HASH_MAX
+};
+
+/* Returned by the verify ioctls when the digest does not match. */
+#define VERIFICATOR_MISMATCH 	1
+
+/*
+ * Restore flag: compare the live code with the supplied bytes and write
+ * only the runs that differ. The restore then reports the number of
+ * bytes patched, 0 when the code was already intact.
+ */
+#define VERIFICATOR_RESTORE_DELTA 	0x1
+
 struct verification_struct {
 	long 		vrf_addr;
 	size_t 		vrf_size;
@@ -13,7 +38,9 @@ struct verificator_verify_struct {
 		};
 		struct verification_struct vs;
 	};
-	unsigned short hash;
+	unsigned long long 	hash;
+	unsigned int 		hash_algo;
+	unsigned long long 	vrf_actual;
 };
 
 struct verificator_get_diff_struct {
@@ -36,12 +63,15 @@ struct verificator_restore_struct {
 		struct verification_struct vs;
 	};
 	void *vrr_code;
+	unsigned int vrr_flags;
 };
 
 #else
 struct verificator_verify_struct {
 	struct verification_struct vs;
-	unsigned short hash;
+	unsigned long long 	hash;
+	unsigned int 		hash_algo;
+	unsigned long long 	vrf_actual;
 };
 
 struct verificator_get_diff_struct {
@@ -52,10 +82,183 @@ struct verificator_get_diff_struct {
 struct verificator_restore_struct {
 	struct verification_struct vs;
 	void	 __user *vrr_code;
+	unsigned int 	vrr_flags;
 };
 #endif
 
 
+/*
+ * One element of VERIFICATOR_VERIFY_BATCH. On return vrf_actual holds the
+ * computed hash and vrf_result is 0, VERIFICATOR_MISMATCH or a negative
+ * errno for this entry.
+ */
+struct verificator_verify_entry {
+	long 			vrf_addr;
+	size_t 			vrf_size;
+	unsigned long long 	hash;
+	unsigned int 		hash_algo;
+	unsigned long long 	vrf_actual;
+	long 			vrf_result;
+};
+
+struct verificator_verify_batch_struct {
+	unsigned int 				vrb_count;
+	struct verificator_verify_entry __user 	*vrb_entries;
+};
+
+#define VERIFICATOR_BATCH_MAX 	65536
+
+/*
+ * Record of the kernel-resident baseline. Entries are keyed by vrf_addr,
+ * loading an address again replaces its record.
+ */
+struct verificator_baseline_entry {
+	long 			vrf_addr;
+	size_t 			vrf_size;
+	unsigned long long 	hash;
+	unsigned int 		hash_algo;
+};
+
+/* Drop the loaded baseline before adding vrl_entries */
+#define VERIFICATOR_BASELINE_REPLACE 	0x1
+
+struct verificator_load_baseline_struct {
+	unsigned int 				vrl_count;
+	unsigned int 				vrl_flags;
+	struct verificator_baseline_entry __user *vrl_entries;
+};
+
+/*
+ * Per-block digests of a region: CRC32C (standard, as in
+ * VERIFICATOR_HASH_CRC32C) of every vbh_block_size bytes, the last block
+ * possibly short. vbh_root rolls them up into a Merkle root: leaves are
+ * pushed onto a stack, equal-height neighbours are merged as
+ * crc32c(left || right) and the remaining stack is folded from the
+ * right. On entry vbh_count is the capacity of vbh_hashes, on return the
+ * number of blocks.
+ */
+#define VERIFICATOR_BLOCK_SIZE 	64
+
+struct verificator_block_hashes_struct {
+	long 			vrf_addr;
+	size_t 			vrf_size;
+	unsigned int 		vbh_block_size; 	/* 0 means VERIFICATOR_BLOCK_SIZE */
+	unsigned int 		vbh_count;
+	unsigned int __user 	*vbh_hashes;
+	unsigned int 		vbh_root;
+};
+
+/*
+ * In-kernel diff against expected bytes supplied by userspace. The result
+ * is a list of runs written to vrd_runs: a struct verificator_diff_run
+ * followed by vdr_length live bytes, the next run starting at
+ * VERIFICATOR_DIFF_RUN_SIZE(vdr_length). Equal gaps shorter than a run
+ * header are folded into the surrounding run. On return vrd_runs_size is
+ * the number of bytes used (or needed, with -ENOSPC) and vrd_count the
+ * number of runs; the ioctl returns the number of differing bytes.
+ */
+struct verificator_diff_run {
+	unsigned int 	vdr_offset;
+	unsigned int 	vdr_length;
+};
+
+#define VERIFICATOR_DIFF_RUN_SIZE(len) \
+	(sizeof(struct verificator_diff_run) + (((len) + 3) & ~3UL))
+
+struct verificator_diff_struct {
+	long 			vrf_addr;
+	size_t 			vrf_size;
+	const void __user 	*vrd_expected;
+	void __user 		*vrd_runs;
+	size_t 			vrd_runs_size;
+	unsigned int 		vrd_count;
+};
+
+/*
+ * One patch of VERIFICATOR_RESTORE_BATCH. All valid entries are written
+ * in a single stop_machine() window; vrr_result is 0 (with
+ * VERIFICATOR_RESTORE_DELTA in vrrb_flags, the number of bytes patched)
+ * or a negative errno for this entry.
+ */
+struct verificator_restore_entry {
+	long 			vrf_addr;
+	size_t 			vrf_size;
+	const void __user 	*vrr_code;
+	long 			vrr_result;
+};
+
+struct verificator_restore_batch_struct {
+	unsigned int 				vrrb_count;
+	unsigned int 				vrrb_flags;
+	struct verificator_restore_entry __user *vrrb_entries;
+};
+
+/*
+ * Parallel scan of a large region, e.g. all of kernel text. The region is
+ * split into pages that one worker per online CPU hashes concurrently;
+ * each page digest is the CRC32C of the page (the last one possibly
+ * short) and vrs_root is their Merkle root, the same as
+ * VERIFICATOR_GET_BLOCK_HASHES with a PAGE_SIZE block. Section bounds
+ * are resolved in userspace, vrs_reserved must be 0. vrs_page_count is
+ * the capacity of vrs_page_hashes and of vrs_expected, either of which
+ * may be NULL, and on return the number of pages (also with -ENOSPC).
+ * Pages whose digest differs from vrs_expected are counted in
+ * vrs_mismatches and sent to the event ring; the ioctl returns the same
+ * count.
+ */
+struct verificator_region_scan_struct {
+	long 				vrf_addr;
+	size_t 				vrf_size;
+	unsigned int 			vrs_reserved;
+	unsigned int 			vrs_page_size;
+	unsigned int 			vrs_page_count;
+	unsigned int 			vrs_mismatches;
+	const unsigned int __user 	*vrs_expected;
+	unsigned int __user 		*vrs_page_hashes;
+	unsigned int 			vrs_root;
+	unsigned int 			vrs_cpus; 	/* workers used */
+	unsigned long long 		vrs_nsec; 	/* wall time of the scan */
+};
+
+/*
+ * Mismatch event ring, mmap()ed from /dev/verificator. The header sits
+ * in the first page and records start at vrh_data_offset, both mapped
+ * read-only from offset 0. The tail, an unsigned int, lives alone in the
+ * page at mmap offset vrh_tail_offset, the only one that may be mapped
+ * read-write. The kernel is the only producer and advances vrh_head with
+ * release semantics; the single consumer advances the tail the same way.
+ * Events that do not fit are counted in vrh_dropped. poll() reports
+ * POLLIN while head != tail. The mask and offsets are informational,
+ * the kernel keeps its own copies.
+ */
+#define VERIFICATOR_EVENT_SCAN 	0x1 	/* found by the in-kernel scanner */
+#define VERIFICATOR_EVENT_REGION 0x2 	/* page of a region scan, CRC32C */
+#define VERIFICATOR_EVENT_PATCHED 0x4 	/* scan of a region text_poke wrote to */
+
+struct verificator_event {
+	unsigned long long 	vre_timestamp; 	/* CLOCK_REALTIME, ns */
+	unsigned long long 	vre_addr;
+	unsigned long long 	vre_size;
+	unsigned long long 	vre_expected;
+	unsigned long long 	vre_actual;
+	unsigned int 		vre_hash_algo;
+	unsigned int 		vre_flags;
+};
+
+struct verificator_ring_header {
+	unsigned int 	vrh_head;
+	unsigned int 	vrh_dropped;
+	unsigned int 	vrh_mask; 		/* number of records - 1 */
+	unsigned int 	vrh_data_offset;
+	unsigned int 	vrh_tail_offset;
+};
+
 #define VERIFICATOR_VERIFY_CODE _IOW('L', 0, struct verificator_verify_struct *)
 #define VERIFICATOR_GET_DIFF 	_IOW('L', 1, struct verificator_get_diff_struct *)
 #define VERIFICATOR_RESTORE 	_IOW('L', 2, struct verificator_restore_struct *)
+#define VERIFICATOR_VERIFY_BATCH _IOW('L', 3, struct verificator_verify_batch_struct *)
+#define VERIFICATOR_LOAD_BASELINE _IOW('L', 4, struct verificator_load_baseline_struct *)
+#define VERIFICATOR_GET_BLOCK_HASHES _IOW('L', 5, struct verificator_block_hashes_struct *)
+#define VERIFICATOR_DIFF 	_IOW('L', 6, struct verificator_diff_struct *)
+#define VERIFICATOR_RESTORE_BATCH _IOW('L', 7, struct verificator_restore_batch_struct *)
+#define VERIFICATOR_SCAN_REGION _IOW('L', 8, struct verificator_region_scan_struct *)
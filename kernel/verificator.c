@@ -7,102 +7,1384 @@
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 #include <linux/crc16.h>
+#include <linux/crc32c.h>
+#include <linux/xxhash.h>
 #include <verificator.h>
 #include <linux/kallsyms.h>
 #include <linux/sched.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include <linux/stop_machine.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/srcu.h>
+#include <linux/rculist.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mempool.h>
+#include <linux/kprobes.h>
+#include <linux/overflow.h>
+#include <linux/sort.h>
 
-typedef long (*access_process_vm_t)(struct task_struct *tsk,
-		unsigned long addr, void *buf, int len, int write);
-access_process_vm_t access_process_vm_func = 0;
+#define CREATE_TRACE_POINTS
+#include "verificator_trace.h"
 
-static int is_verificator_opened = 0;
+/*
+ * State of one open file. Any number of files may be open at once and
+ * the ioctls of all of them run concurrently; the shared baseline table
+ * and event ring have their own locking.
+ */
+struct verificator_session {
+	pid_t 		tgid; 		/* opener */
+};
+
+/* Session allowed to consume the event ring through mmap() */
+static struct verificator_session *ring_consumer;
+
+static int verificator_open(struct inode *inode, struct file *file)
+{
+	struct verificator_session *session;
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (session == NULL) {
+		return -ENOMEM;
+	}
+
+	session->tgid = task_tgid_nr(current);
+	file->private_data = session;
+
+	return 0;
+}
+
+static int verificator_release(struct inode *inode, struct file *file)
+{
+	struct verificator_session *session = file->private_data;
+
+	(void)cmpxchg(&ring_consumer, session, NULL);
+	kfree(session);
+
+	return 0;
+}
+
+/*
+ * Per-CPU counters of every ioctl (by _IOC_NR) and of the background
+ * scan, summed up only when debugfs is read. Latencies go into log2
+ * buckets: bucket i counts calls that took [2^i, 2^(i+1)) ns.
+ */
+#define VERIFICATOR_STATS_BUCKETS 	32
+#define VERIFICATOR_STAT_SCAN 		9
+#define VERIFICATOR_STAT_OPS 		10
+
+static const char * const verificator_stat_names[VERIFICATOR_STAT_OPS] = {
+	"verify_code", "get_diff", "restore", "verify_batch", "load_baseline",
+	"block_hashes", "diff", "restore_batch", "scan_region", "scan",
+};
+
+struct verificator_op_stats {
+	u64 	calls;
+	u64 	errors;
+	u64 	enomem;
+	u64 	nsec;
+	u64 	hist[VERIFICATOR_STATS_BUCKETS];
+};
+
+struct verificator_stats {
+	struct verificator_op_stats 	ops[VERIFICATOR_STAT_OPS];
+	u64 				bytes_hashed;
+	u64 				mismatches;
+};
+
+static DEFINE_PER_CPU(struct verificator_stats, verificator_cpu_stats);
+static struct dentry *verificator_debugfs;
+
+static void verificator_stats_account(unsigned int op, long ret, u64 nsec)
+{
+	unsigned int bucket = nsec ? min_t(unsigned int, ilog2(nsec),
+					VERIFICATOR_STATS_BUCKETS - 1) : 0;
+
+	this_cpu_inc(verificator_cpu_stats.ops[op].calls);
+	this_cpu_add(verificator_cpu_stats.ops[op].nsec, nsec);
+	this_cpu_inc(verificator_cpu_stats.ops[op].hist[bucket]);
+	if (ret < 0) {
+		this_cpu_inc(verificator_cpu_stats.ops[op].errors);
+	}
+	if (ret == -ENOMEM) {
+		this_cpu_inc(verificator_cpu_stats.ops[op].enomem);
+	}
+}
+
+/* One line per operation, then the totals; parsed by code_analizator --stats */
+static int verificator_stats_show(struct seq_file *m, void *v)
+{
+	u64 	bytes_hashed = 0;
+	u64 	mismatches = 0;
+	int 	cpu;
+	int 	op, i;
+
+	for (op = 0; op < VERIFICATOR_STAT_OPS; op++) {
+		struct verificator_op_stats sum = { 0 };
+
+		for_each_possible_cpu(cpu) {
+			const struct verificator_op_stats *st =
+				&per_cpu_ptr(&verificator_cpu_stats, cpu)->ops[op];
+
+			sum.calls += st->calls;
+			sum.errors += st->errors;
+			sum.enomem += st->enomem;
+			sum.nsec += st->nsec;
+			for (i = 0; i < VERIFICATOR_STATS_BUCKETS; i++) {
+				sum.hist[i] += st->hist[i];
+			}
+		}
+
+		seq_printf(m, "%s calls %llu errors %llu enomem %llu nsec %llu hist",
+			verificator_stat_names[op], sum.calls, sum.errors, sum.enomem, sum.nsec);
+		for (i = 0; i < VERIFICATOR_STATS_BUCKETS; i++) {
+			seq_printf(m, " %llu", sum.hist[i]);
+		}
+		seq_putc(m, '\n');
+	}
+
+	for_each_possible_cpu(cpu) {
+		bytes_hashed += per_cpu_ptr(&verificator_cpu_stats, cpu)->bytes_hashed;
+		mismatches += per_cpu_ptr(&verificator_cpu_stats, cpu)->mismatches;
+	}
+	seq_printf(m, "bytes_hashed %llu\nmismatches %llu\n", bytes_hashed, mismatches);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(verificator_stats);
+
+/*
+ * Mismatch event ring shared with userspace through mmap(). Reports may
+ * come from several ioctl callers and the scanner at once, ring_lock
+ * serializes them so the ring itself stays single-producer. Userspace
+ * can only write the tail page; the producer never trusts anything it
+ * reads back from the mapping except the tail.
+ */
+static unsigned int ring_records = 4096;
+module_param(ring_records, uint, 0444);
+MODULE_PARM_DESC(ring_records, "Number of records in the mismatch event ring");
+
+static struct verificator_ring_header *ring;
+static struct verificator_event *ring_events;
+static unsigned int *ring_tail;
+static unsigned int ring_mask;
+static size_t ring_size;
+static DEFINE_SPINLOCK(ring_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+
+static int verificator_ring_init(void)
+{
+	size_t tail_offset;
+
+	ring_records = roundup_pow_of_two(clamp(ring_records, 2U, 1U << 20));
+	tail_offset = PAGE_ALIGN(PAGE_SIZE + ring_records * sizeof(struct verificator_event));
+	ring_size = tail_offset + PAGE_SIZE;
+
+	ring = vmalloc_user(ring_size);
+	if (ring == NULL) {
+		return -ENOMEM;
+	}
+
+	ring_mask = ring_records - 1;
+	ring_events = (struct verificator_event *)((char *)ring + PAGE_SIZE);
+	ring_tail = (unsigned int *)((char *)ring + tail_offset);
+
+	ring->vrh_mask = ring_mask;
+	ring->vrh_data_offset = PAGE_SIZE;
+	ring->vrh_tail_offset = tail_offset;
+
+	return 0;
+}
+
+static void verificator_report_mismatch(unsigned long addr, size_t size,
+				unsigned int hash_algo, u64 expected, u64 actual,
+				unsigned int flags)
+{
+	struct verificator_event *ev;
+	unsigned long irqflags;
+	unsigned int head, tail;
+
+	this_cpu_inc(verificator_cpu_stats.mismatches);
+
+	spin_lock_irqsave(&ring_lock, irqflags);
+
+	head = ring->vrh_head;
+	tail = smp_load_acquire(ring_tail);
+	if (head - tail > ring_mask) {
+		ring->vrh_dropped++;
+		spin_unlock_irqrestore(&ring_lock, irqflags);
+		return;
+	}
+
+	ev = &ring_events[head & ring_mask];
+	ev->vre_timestamp = ktime_get_real_ns();
+	ev->vre_addr = addr;
+	ev->vre_size = size;
+	ev->vre_expected = expected;
+	ev->vre_actual = actual;
+	ev->vre_hash_algo = hash_algo;
+	ev->vre_flags = flags;
+
+	smp_store_release(&ring->vrh_head, head + 1);
+
+	spin_unlock_irqrestore(&ring_lock, irqflags);
+
+	wake_up_interruptible(&ring_wait);
+}
+
+/*
+ * The header and records are mapped read-only from offset 0 by anyone.
+ * The tail page at vrh_tail_offset is the only writable part and has a
+ * single consumer: the first session that maps it owns the tail until
+ * its file is released, other sessions may still poll().
+ */
+static int verificator_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct verificator_session *session = file->private_data;
+	struct verificator_session *owner;
+	size_t tail_offset = ring->vrh_tail_offset;
+	size_t size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff == 0) {
+		if (size > tail_offset || (vma->vm_flags & VM_WRITE)) {
+			return -EINVAL;
+		}
+		vm_flags_clear(vma, VM_MAYWRITE);
+
+		return remap_vmalloc_range(vma, ring, 0);
+	}
+
+	if (vma->vm_pgoff != tail_offset >> PAGE_SHIFT || size != PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	owner = cmpxchg(&ring_consumer, NULL, session);
+	if (owner != NULL && owner != session) {
+		printk(KERN_ERR "Event ring is already consumed by %d\n", owner->tgid);
+		return -EBUSY;
+	}
+
+	return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+static __poll_t verificator_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &ring_wait, wait);
+
+	if (READ_ONCE(ring->vrh_head) != READ_ONCE(*ring_tail)) {
+		return EPOLLIN | EPOLLRDNORM;
+	}
+
+	return 0;
+}
+
+/* Code is hashed and compared in place, so the whole range must be mapped */
+#define VERIFICATOR_SIZE_MAX 	(256UL << 20)
+
+static bool is_verify_struct_valid(struct verification_struct *args)
+{
+	unsigned long last;
+
+	return args && (args->vrf_size != 0) && args->vrf_size <= VERIFICATOR_SIZE_MAX &&
+		!check_add_overflow((unsigned long)args->vrf_addr,
+				(unsigned long)args->vrf_size - 1, &last) &&
+		virt_addr_valid(args->vrf_addr) && virt_addr_valid(last);
+}
+
+/*
+ * Code is hashed in place, VERIFICATOR_HASH_CHUNK bytes at a time, with a
+ * reschedule point between chunks so whole sections can be verified.
+ */
+#define VERIFICATOR_HASH_CHUNK (16 * PAGE_SIZE)
+
+static bool is_hash_algo_valid(unsigned int algo)
+{
+	return algo < VERIFICATOR_HASH_MAX;
+}
+
+/*
+ * crc32c() ends up in the SSE4.2 crc32 instruction (crc32c-intel) when
+ * the CPU has it, xxh64 is the kernel's lib/xxhash implementation.
+ */
+static u64 verificator_hash_code(unsigned int algo, const unsigned char *code, size_t code_sz)
+{
+	struct xxh64_state xxh;
+	u64 hash = 0;
+
+	this_cpu_add(verificator_cpu_stats.bytes_hashed, code_sz);
+
+	if (algo == VERIFICATOR_HASH_CRC32C) {
+		hash = ~0U;
+	} else if (algo == VERIFICATOR_HASH_XXH64) {
+		xxh64_reset(&xxh, 0);
+	}
+
+	while (code_sz) {
+		size_t chunk = min_t(size_t, code_sz, VERIFICATOR_HASH_CHUNK);
+
+		switch (algo) {
+			case VERIFICATOR_HASH_CRC16:
+				hash = crc16((u16)hash, code, chunk);
+				break;
+			case VERIFICATOR_HASH_CRC32C:
+				hash = crc32c((u32)hash, code, chunk);
+				break;
+			case VERIFICATOR_HASH_XXH64:
+				xxh64_update(&xxh, code, chunk);
+				break;
+		}
+		code += chunk;
+		code_sz -= chunk;
+
+		if (code_sz) {
+			cond_resched();
+		}
+	}
+
+	if (algo == VERIFICATOR_HASH_CRC32C) {
+		hash = (u32)~hash;
+	} else if (algo == VERIFICATOR_HASH_XXH64) {
+		hash = xxh64_digest(&xxh);
+	}
+
+	return hash;
+}
+
+/* Start of a traced call, read only while the event is on */
+#define trace_start(event) 	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+#define trace_duration(start) 	((start) ? ktime_get_ns() - (start) : 0)
+
+static long verificator_verify_code(struct verificator_verify_struct *args)
+{
+	u64 start = trace_start(verificator_verify);
+
+	if (!is_verify_struct_valid((struct verification_struct *)args) ||
+			!is_hash_algo_valid(args->hash_algo)) {
+		return -EINVAL;
+	}
+
+	args->vrf_actual = verificator_hash_code(args->hash_algo,
+					(const unsigned char *)args->vs.vrf_addr,
+					args->vs.vrf_size);
+	trace_verificator_verify(args->vs.vrf_addr, args->vs.vrf_size, args->hash_algo,
+				args->hash, args->vrf_actual, trace_duration(start));
+	if (args->vrf_actual != args->hash) {
+		verificator_report_mismatch(args->vs.vrf_addr, args->vs.vrf_size,
+					args->hash_algo, args->hash, args->vrf_actual, 0);
+		return VERIFICATOR_MISMATCH;
+	}
+
+	return 0;
+}
+
+/*
+ * Scratch buffers of the ioctl paths: a slab cache of scratch_size
+ * objects backed by a mempool of scratch_buffers reserved ones, so taking
+ * a buffer is a slab freelist pop in the common case, never zeroes it and
+ * still succeeds under memory pressure by waiting for a buffer to come
+ * back. Requests that do not fit one buffer are processed in chunks.
+ */
+static unsigned int scratch_size = 4 * PAGE_SIZE;
+module_param(scratch_size, uint, 0444);
+MODULE_PARM_DESC(scratch_size, "Bytes per ioctl scratch buffer");
+
+static unsigned int scratch_buffers;
+module_param(scratch_buffers, uint, 0444);
+MODULE_PARM_DESC(scratch_buffers, "Scratch buffers kept in reserve, 0 means one per CPU");
+
+static struct kmem_cache *scratch_cache;
+static mempool_t *scratch_pool;
+
+static int verificator_scratch_init(void)
+{
+	scratch_size = clamp_t(unsigned int, scratch_size, PAGE_SIZE, 64 * PAGE_SIZE);
+	if (scratch_buffers == 0) {
+		scratch_buffers = num_possible_cpus();
+	}
+
+	scratch_cache = kmem_cache_create("verificator_scratch", scratch_size, 0, 0, NULL);
+	if (scratch_cache == NULL) {
+		return -ENOMEM;
+	}
+
+	scratch_pool = mempool_create_slab_pool(scratch_buffers, scratch_cache);
+	if (scratch_pool == NULL) {
+		kmem_cache_destroy(scratch_cache);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void verificator_scratch_exit(void)
+{
+	mempool_destroy(scratch_pool);
+	kmem_cache_destroy(scratch_cache);
+}
+
+/* Sleeps rather than fails, see mempool_alloc() */
+static inline void *scratch_get(void)
+{
+	return mempool_alloc(scratch_pool, GFP_KERNEL);
+}
+
+static inline void scratch_put(void *buf)
+{
+	mempool_free(buf, scratch_pool);
+}
+
+#define VERIFICATOR_BATCH_CHUNK (scratch_size / sizeof(struct verificator_verify_entry))
+
+static long verificator_verify_batch(struct verificator_verify_batch_struct *args)
+{
+	struct verificator_verify_entry *entries;
+	struct verificator_verify_entry __user *uentries;
+	unsigned int	done = 0;
+	long		mismatches = 0;
+	long		ret = 0;
+
+	if (args->vrb_count == 0 || args->vrb_count > VERIFICATOR_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	entries = scratch_get();
+
+	uentries = args->vrb_entries;
+	while (done < args->vrb_count) {
+		unsigned int chunk = min_t(unsigned int, args->vrb_count - done,
+						VERIFICATOR_BATCH_CHUNK);
+		unsigned int i;
+
+		if (copy_from_user(entries, uentries + done, chunk * sizeof(*entries))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < chunk; i++) {
+			struct verificator_verify_struct vargs = {
+				.vs = {
+					.vrf_addr = entries[i].vrf_addr,
+					.vrf_size = entries[i].vrf_size,
+				},
+				.hash = entries[i].hash,
+				.hash_algo = entries[i].hash_algo,
+			};
+
+			entries[i].vrf_result = verificator_verify_code(&vargs);
+			entries[i].vrf_actual = vargs.vrf_actual;
+			if (entries[i].vrf_result == VERIFICATOR_MISMATCH) {
+				mismatches++;
+			}
+		}
+
+		if (copy_to_user(uentries + done, entries, chunk * sizeof(*entries))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		done += chunk;
+		cond_resched();
+	}
+
+	scratch_put(entries);
+
+	if (mismatches) {
+		printk_ratelimited(KERN_ERR "Batch verify: %ld of %u regions modified\n",
+				mismatches, args->vrb_count);
+	}
+
+	return ret ? ret : mismatches;
+}
+
+/*
+ * Kernel-resident baseline, re-verified by scan_work every
+ * scan_interval_ms without any help from userspace. Writers serialize on
+ * baseline_lock and never modify a published record, they replace it;
+ * the scanner walks the table under SRCU so a long scan, which sleeps,
+ * does not hold up loads.
+ */
+struct verificator_baseline {
+	struct hlist_node 	node;
+	struct rcu_head 	rcu;
+	unsigned long 		addr;
+	size_t 			size;
+	u64 			hash;
+	unsigned int 		hash_algo;
+	bool 			mismatch; 	/* only touched by the scanner */
+	u64 			checked_gen; 	/* text_generation of the last check, 0 never */
+	u64 			dirty_gen; 	/* last legitimate patch seen inside */
+};
+
+#define VERIFICATOR_BASELINE_BITS 	12
+
+static DEFINE_HASHTABLE(baseline_table, VERIFICATOR_BASELINE_BITS);
+static DEFINE_MUTEX(baseline_lock);
+DEFINE_STATIC_SRCU(baseline_srcu);
+static unsigned int baseline_count;
+
+static unsigned int baseline_max = 1 << 20;
+module_param(baseline_max, uint, 0644);
+MODULE_PARM_DESC(baseline_max, "Maximum number of kernel-resident baseline records");
+
+static void verificator_scan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scan_work, verificator_scan);
+
+static unsigned int scan_interval_ms;
+
+/* scan_interval_ms may be set at insmod, before there is anything to scan */
+static bool scan_ready;
+
+/*
+ * A pending scan keeps its deadline, so that loads coming more often than
+ * scan_interval_ms cannot keep pushing the scan back. Only a new interval
+ * re-arms it.
+ */
+static void verificator_schedule_scan(bool rearm)
+{
+	if (!READ_ONCE(scan_ready)) {
+		return;
+	}
+
+	if (scan_interval_ms == 0) {
+		cancel_delayed_work(&scan_work);
+	} else if (rearm) {
+		mod_delayed_work(system_unbound_wq, &scan_work,
+				msecs_to_jiffies(scan_interval_ms));
+	} else {
+		queue_delayed_work(system_unbound_wq, &scan_work,
+				msecs_to_jiffies(scan_interval_ms));
+	}
+}
+
+static int scan_interval_set(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_uint(val, kp);
+
+	if (err == 0) {
+		verificator_schedule_scan(true);
+	}
+
+	return err;
+}
+
+static const struct kernel_param_ops scan_interval_ops = {
+	.set = scan_interval_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(scan_interval_ms, &scan_interval_ops, &scan_interval_ms, 0644);
+MODULE_PARM_DESC(scan_interval_ms, "Period of the baseline scan in ms, 0 disables it");
+
+static struct verificator_baseline *baseline_lookup(unsigned long addr)
+{
+	struct verificator_baseline *vb;
+
+	hash_for_each_possible(baseline_table, vb, node, addr) {
+		if (vb->addr == addr) {
+			return vb;
+		}
+	}
+
+	return NULL;
+}
+
+static void baseline_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct verificator_baseline, rcu));
+}
+
+static void baseline_clear(void)
+{
+	struct verificator_baseline *vb;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(baseline_table, bkt, tmp, vb, node) {
+		hash_del_rcu(&vb->node);
+		call_srcu(&baseline_srcu, &vb->rcu, baseline_free_rcu);
+	}
+	WRITE_ONCE(baseline_count, 0);
+}
+
+static int baseline_add(const struct verificator_baseline_entry *entry)
+{
+	struct verification_struct vs = {
+		.vrf_addr = entry->vrf_addr,
+		.vrf_size = entry->vrf_size,
+	};
+	struct verificator_baseline *vb, *old;
+
+	if (!is_verify_struct_valid(&vs) || !is_hash_algo_valid(entry->hash_algo)) {
+		return -EINVAL;
+	}
+
+	old = baseline_lookup(entry->vrf_addr);
+	if (old == NULL && baseline_count >= baseline_max) {
+		return -ENOSPC;
+	}
+
+	vb = kzalloc(sizeof(*vb), GFP_KERNEL);
+	if (vb == NULL) {
+		return -ENOMEM;
+	}
+
+	vb->addr = entry->vrf_addr;
+	vb->size = entry->vrf_size;
+	vb->hash = entry->hash;
+	vb->hash_algo = entry->hash_algo;
+
+	if (old) {
+		hlist_replace_rcu(&old->node, &vb->node);
+		call_srcu(&baseline_srcu, &old->rcu, baseline_free_rcu);
+	} else {
+		hash_add_rcu(baseline_table, &vb->node, vb->addr);
+		WRITE_ONCE(baseline_count, baseline_count + 1);
+	}
+
+	return 0;
+}
+
+#define VERIFICATOR_BASELINE_CHUNK (scratch_size / sizeof(struct verificator_baseline_entry))
+
+static long verificator_load_baseline(struct verificator_load_baseline_struct *args)
+{
+	struct verificator_baseline_entry *entries;
+	unsigned int	done = 0;
+	long		ret = 0;
+
+	if (args->vrl_count > VERIFICATOR_BATCH_MAX ||
+			(args->vrl_flags & ~VERIFICATOR_BASELINE_REPLACE)) {
+		return -EINVAL;
+	}
+
+	entries = scratch_get();
+
+	mutex_lock(&baseline_lock);
+
+	if (args->vrl_flags & VERIFICATOR_BASELINE_REPLACE) {
+		baseline_clear();
+	}
+
+	while (done < args->vrl_count) {
+		unsigned int chunk = min_t(unsigned int, args->vrl_count - done,
+						VERIFICATOR_BASELINE_CHUNK);
+		unsigned int i;
+
+		if (copy_from_user(entries, args->vrl_entries + done,
+					chunk * sizeof(*entries))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < chunk && ret == 0; i++) {
+			ret = baseline_add(&entries[i]);
+		}
+		if (ret) {
+			break;
+		}
+
+		done += chunk;
+	}
+
+	if (ret == 0) {
+		ret = baseline_count;
+	}
+
+	mutex_unlock(&baseline_lock);
+	scratch_put(entries);
+
+	verificator_schedule_scan(false);
+
+	return ret;
+}
+
+/* Re-hashes one record, reporting it once when it turns bad */
+static bool baseline_check(struct verificator_baseline *vb, bool patched)
+{
+	u64 actual = verificator_hash_code(vb->hash_algo,
+				(const unsigned char *)vb->addr, vb->size);
+	bool mismatch = actual != vb->hash;
+
+	if (mismatch && !vb->mismatch) {
+		verificator_report_mismatch(vb->addr, vb->size, vb->hash_algo,
+					vb->hash, actual, VERIFICATOR_EVENT_SCAN |
+					(patched ? VERIFICATOR_EVENT_PATCHED : 0));
+	}
+	vb->mismatch = mismatch;
+
+	return mismatch;
+}
+
+/*
+ * Legitimate text patching: alternatives, jump labels, ftrace and with it
+ * livepatch all end up in text_poke() and friends, which are kretprobed
+ * to log the poked ranges together with a new text_generation once the
+ * bytes are written. Scheduled scans then only re-hash records that were
+ * never checked or were patched since their last check, and every
+ * scan_full_every-th scan (or one after the log overflowed) re-hashes
+ * everything to catch writes that bypass the patching API.
+ */
+#define VERIFICATOR_DIRTY_RANGES 	256
+
+struct dirty_range {
+	unsigned long 	start;
+	unsigned long 	end;
+	u64 		gen;
+};
+
+static struct dirty_range dirty_ranges[VERIFICATOR_DIRTY_RANGES];
+static unsigned int dirty_count;
+static bool dirty_overflow;
+static u64 text_generation = 1;
+static DEFINE_SPINLOCK(dirty_lock);
+
+/* Scanner-private copy of the log */
+static struct dirty_range scan_ranges[VERIFICATOR_DIRTY_RANGES];
+
+static unsigned int scan_full_every = 16;
+module_param(scan_full_every, uint, 0644);
+MODULE_PARM_DESC(scan_full_every, "Re-hash every region on each Nth scan, 1 does it every time");
+
+static bool text_poke_tracked;
+
+static void dirty_log(unsigned long start, size_t len)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dirty_lock, flags);
+	text_generation++;
+	if (dirty_count && dirty_ranges[dirty_count - 1].end == start) {
+		/* Sequential pokes of one patch site */
+		dirty_ranges[dirty_count - 1].end = start + len;
+		dirty_ranges[dirty_count - 1].gen = text_generation;
+	} else if (dirty_count < VERIFICATOR_DIRTY_RANGES) {
+		dirty_ranges[dirty_count++] = (struct dirty_range){
+			.start = start,
+			.end = start + len,
+			.gen = text_generation,
+		};
+	} else {
+		dirty_overflow = true;
+	}
+	spin_unlock_irqrestore(&dirty_lock, flags);
+}
+
+struct text_poke_args {
+	unsigned long 	addr;
+	size_t 		len;
+};
+
+/* text_poke(addr, opcode, len) and its siblings share the argument layout */
+static int text_poke_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct text_poke_args *args = (struct text_poke_args *)ri->data;
+
+	args->addr = regs_get_kernel_argument(regs, 0);
+	args->len = regs_get_kernel_argument(regs, 2);
+	return 0;
+}
+
+/*
+ * Logged on return: a scan between the log and the write would otherwise
+ * move checked_gen past a patch it hashed before the patch landed.
+ */
+static int text_poke_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct text_poke_args *args = (struct text_poke_args *)ri->data;
+
+	dirty_log(args->addr, args->len);
+	return 0;
+}
+
+#define TEXT_POKE_PROBE(sym) { 					\
+	.kp.symbol_name = sym, 					\
+	.entry_handler = text_poke_entry, 			\
+	.handler = text_poke_ret, 				\
+	.data_size = sizeof(struct text_poke_args), 		\
+}
+
+static struct kretprobe text_poke_probes[] = {
+	TEXT_POKE_PROBE("text_poke"),
+	TEXT_POKE_PROBE("text_poke_copy"),
+	TEXT_POKE_PROBE("text_poke_set"),
+};
+static bool text_poke_registered[ARRAY_SIZE(text_poke_probes)];
+
+static void verificator_dirty_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(text_poke_probes); i++) {
+		text_poke_registered[i] = register_kretprobe(&text_poke_probes[i]) == 0;
+	}
+	/* Without text_poke itself nothing legitimate is seen, scan it all */
+	text_poke_tracked = text_poke_registered[0];
+	if (!text_poke_tracked) {
+		printk(KERN_ERR "Cannot probe text_poke, every scan is a full one\n");
+	}
+}
+
+static void verificator_dirty_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(text_poke_probes); i++) {
+		if (text_poke_registered[i]) {
+			unregister_kretprobe(&text_poke_probes[i]);
+		}
+	}
+}
+
+static int dirty_range_cmp(const void *a, const void *b)
+{
+	const struct dirty_range *l = a, *r = b;
+
+	return l->start < r->start ? -1 : l->start > r->start;
+}
+
+/*
+ * Sorts the drained ranges and merges the overlapping ones, keeping the
+ * newest generation, so that each record is looked up by binary search.
+ */
+static int dirty_merge(int count)
+{
+	int i, n = 0;
+
+	sort(scan_ranges, count, sizeof(*scan_ranges), dirty_range_cmp, NULL);
+
+	for (i = 1; i < count; i++) {
+		struct dirty_range *last = &scan_ranges[n];
+
+		if (scan_ranges[i].start <= last->end) {
+			last->end = max(last->end, scan_ranges[i].end);
+			last->gen = max(last->gen, scan_ranges[i].gen);
+		} else {
+			scan_ranges[++n] = scan_ranges[i];
+		}
+	}
+
+	return n + 1;
+}
+
+/*
+ * Takes the logged ranges; *gen covers all of them since poking bumps
+ * the generation under the same lock. Returns -1 after an overflow or
+ * when a kretprobe ran out of instances and missed a poke.
+ */
+static int dirty_drain(u64 *gen)
+{
+	static unsigned long seen_missed;
+	unsigned long missed = 0;
+	unsigned long flags;
+	unsigned int i;
+	int count;
+
+	for (i = 0; i < ARRAY_SIZE(text_poke_probes); i++) {
+		missed += READ_ONCE(text_poke_probes[i].nmissed);
+	}
+
+	spin_lock_irqsave(&dirty_lock, flags);
+	count = dirty_overflow || missed != seen_missed ? -1 : dirty_count;
+	seen_missed = missed;
+	if (count > 0) {
+		memcpy(scan_ranges, dirty_ranges, count * sizeof(*scan_ranges));
+	}
+	dirty_count = 0;
+	dirty_overflow = false;
+	*gen = text_generation;
+	spin_unlock_irqrestore(&dirty_lock, flags);
+
+	return count > 0 ? dirty_merge(count) : count;
+}
+
+static void baseline_mark_dirty(struct verificator_baseline *vb, int nranges)
+{
+	unsigned long end = vb->addr + vb->size;
+	u64 gen = 0;
+	int lo = 0, hi = nranges;
+
+	if (nranges <= 0) {
+		return;
+	}
+
+	/* First range ending past the record, the ends are sorted as well */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (scan_ranges[mid].end <= vb->addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < nranges && scan_ranges[lo].start < end; lo++) {
+		gen = max(gen, scan_ranges[lo].gen);
+	}
+
+	if (gen > READ_ONCE(vb->dirty_gen)) {
+		WRITE_ONCE(vb->dirty_gen, gen);
+	}
+}
+
+static void verificator_scan(struct work_struct *work)
+{
+	static unsigned int scans;
+	struct verificator_baseline *vb;
+	unsigned int mismatches = 0;
+	u64 start = ktime_get_ns();
+	u64 gen;
+	bool full;
+	int nranges;
+	int bkt, idx;
+
+	nranges = dirty_drain(&gen);
+	scans++;
+	full = nranges < 0 || !text_poke_tracked || scan_full_every <= 1 ||
+		scans % scan_full_every == 0;
+
+	idx = srcu_read_lock(&baseline_srcu);
+
+	for (bkt = 0; bkt < HASH_SIZE(baseline_table); bkt++) {
+		hlist_for_each_entry_srcu(vb, &baseline_table[bkt], node,
+					srcu_read_lock_held(&baseline_srcu)) {
+			bool patched;
+
+			baseline_mark_dirty(vb, nranges);
+			patched = READ_ONCE(vb->dirty_gen) > vb->checked_gen;
+			if (!full && !patched && vb->checked_gen) {
+				continue;
+			}
+
+			mismatches += baseline_check(vb, patched && vb->checked_gen);
+			vb->checked_gen = gen;
+			cond_resched();
+		}
+	}
+
+	srcu_read_unlock(&baseline_srcu, idx);
+
+	verificator_stats_account(VERIFICATOR_STAT_SCAN, mismatches, ktime_get_ns() - start);
+
+	if (mismatches) {
+		printk_ratelimited(KERN_ERR "Baseline scan: %u of %u regions modified\n",
+				mismatches, READ_ONCE(baseline_count));
+	}
+
+	if (scan_interval_ms) {
+		queue_delayed_work(system_unbound_wq, &scan_work,
+				msecs_to_jiffies(scan_interval_ms));
+	}
+}
+
+static inline u32 block_crc32c(const void *data, size_t len)
+{
+	this_cpu_add(verificator_cpu_stats.bytes_hashed, len);
+	return ~crc32c(~0U, data, len);
+}
 
-static int verificator_open(struct inode *inode, struct file *file)
+/* Stack of pending Merkle subtrees, see struct verificator_block_hashes_struct */
+struct merkle_stack {
+	u32 		hash[BITS_PER_LONG];
+	unsigned char 	height[BITS_PER_LONG];
+	unsigned int 	depth;
+};
+
+static inline u32 merkle_node(u32 left, u32 right)
 {
-	if (!capable(CAP_SYS_ADMIN)) {
-		return -EPERM;
+	__le32 pair[2] = { cpu_to_le32(left), cpu_to_le32(right) };
+
+	return block_crc32c(pair, sizeof(pair));
+}
+
+static void merkle_push(struct merkle_stack *ms, u32 hash)
+{
+	unsigned char height = 0;
+
+	while (ms->depth && ms->height[ms->depth - 1] == height) {
+		hash = merkle_node(ms->hash[--ms->depth], hash);
+		height++;
 	}
 
-	if (cmpxchg(&is_verificator_opened, 0, 1)) {
-		return -EBUSY;
+	ms->hash[ms->depth] = hash;
+	ms->height[ms->depth++] = height;
+}
+
+static u32 merkle_root(struct merkle_stack *ms)
+{
+	u32 hash;
+
+	if (ms->depth == 0) {
+		return 0;
 	}
 
-	return 0;
+	hash = ms->hash[--ms->depth];
+	while (ms->depth) {
+		hash = merkle_node(ms->hash[--ms->depth], hash);
+	}
+
+	return hash;
 }
 
-static int verificator_release(struct inode *inode, struct file *file)
+#define VERIFICATOR_BLOCK_HASH_CHUNK 	64
+
+static long verificator_block_hashes(struct verificator_block_hashes_struct *args)
 {
-	(void)cmpxchg(&is_verificator_opened, 1, 0);
+	struct merkle_stack ms = { .depth = 0 };
+	u32 		hashes[VERIFICATOR_BLOCK_HASH_CHUNK];
+	const u8 	*code;
+	size_t 		remaining;
+	unsigned int 	block_size;
+	unsigned int 	count;
+	unsigned int 	done = 0;
 
-	return 0;
+	if (!is_verify_struct_valid((struct verification_struct *)args)) {
+		return -EINVAL;
+	}
+
+	block_size = args->vbh_block_size ? args->vbh_block_size : VERIFICATOR_BLOCK_SIZE;
+	if (!is_power_of_2(block_size) || block_size < 16 || block_size > PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	count = DIV_ROUND_UP(args->vs.vrf_size, block_size);
+	if (args->vbh_count < count) {
+		args->vbh_count = count;
+		return -ENOSPC;
+	}
+
+	code = (const u8 *)args->vs.vrf_addr;
+	remaining = args->vs.vrf_size;
+
+	while (done < count) {
+		unsigned int chunk = min_t(unsigned int, count - done, VERIFICATOR_BLOCK_HASH_CHUNK);
+		unsigned int i;
+
+		for (i = 0; i < chunk; i++) {
+			size_t len = min_t(size_t, remaining, block_size);
+
+			hashes[i] = block_crc32c(code, len);
+			merkle_push(&ms, hashes[i]);
+			code += len;
+			remaining -= len;
+		}
+
+		if (copy_to_user(args->vbh_hashes + done, hashes, chunk * sizeof(u32))) {
+			return -EFAULT;
+		}
+
+		done += chunk;
+		cond_resched();
+	}
+
+	args->vbh_block_size = block_size;
+	args->vbh_count = count;
+	args->vbh_root = merkle_root(&ms);
+
+	return count;
 }
 
-static bool is_verify_struct_valid(struct verification_struct *args)
+/*
+ * Region scans: pages are claimed one at a time from a shared counter by
+ * a work item queued on every online CPU, so the scan spreads over all
+ * cores and a slow CPU just ends up hashing fewer pages.
+ */
+#define VERIFICATOR_REGION_MAX_PAGES 	(1U << 20)
+
+static struct workqueue_struct *region_wq;
+
+struct region_scan {
+	const u8 		*base;
+	size_t 			size;
+	unsigned int 		pages;
+	u32 			*hashes;
+	atomic_t 		next;
+	atomic_t 		pending;
+	struct completion 	done;
+};
+
+struct region_worker {
+	struct work_struct 	work;
+	struct region_scan 	*scan;
+};
+
+static void region_scan_work(struct work_struct *work)
 {
-	return args && (args->vrf_size != 0) && virt_addr_valid(args->vrf_addr);
+	struct region_worker *worker = container_of(work, struct region_worker, work);
+	struct region_scan *scan = worker->scan;
+	unsigned int page;
+
+	while ((page = atomic_inc_return(&scan->next) - 1) < scan->pages) {
+		size_t offset = (size_t)page << PAGE_SHIFT;
+
+		scan->hashes[page] = block_crc32c(scan->base + offset,
+					min_t(size_t, scan->size - offset, PAGE_SIZE));
+		cond_resched();
+	}
+
+	if (atomic_dec_and_test(&scan->pending)) {
+		complete(&scan->done);
+	}
 }
 
-static long verificator_verify_code(struct verificator_verify_struct *args)
+static unsigned int region_scan_run(struct region_scan *scan)
 {
-	char 	*code 	  = NULL;
-	size_t  code_sz	  = 0;
-	long	code_addr = 0;
-	unsigned short crc = 0;
+	struct region_worker 	self = { .scan = scan };
+	struct region_worker 	*workers;
+	unsigned int 		nworkers = 0;
+	unsigned int 		cpu;
 
-	if (!is_verify_struct_valid((struct verification_struct *)args)) {
+	workers = kcalloc(num_possible_cpus(), sizeof(*workers), GFP_KERNEL);
+
+	atomic_set(&scan->next, 0);
+	atomic_set(&scan->pending, 1);
+	init_completion(&scan->done);
+
+	if (workers) {
+		cpus_read_lock();
+		for_each_online_cpu(cpu) {
+			if (nworkers == scan->pages) {
+				break;
+			}
+
+			workers[nworkers].scan = scan;
+			INIT_WORK(&workers[nworkers].work, region_scan_work);
+			atomic_inc(&scan->pending);
+			queue_work_on(cpu, region_wq, &workers[nworkers].work);
+			nworkers++;
+		}
+		cpus_read_unlock();
+	}
+
+	/* The caller pitches in too, which also covers a failed allocation */
+	region_scan_work(&self.work);
+	wait_for_completion(&scan->done);
+
+	kfree(workers);
+	return nworkers + 1;
+}
+
+static long verificator_scan_region(struct verificator_region_scan_struct *args)
+{
+	struct merkle_stack ms = { .depth = 0 };
+	struct region_scan 	scan;
+	u32 			*expected = NULL;
+	unsigned int 		mismatches = 0;
+	unsigned int 		i;
+	u64 			start;
+	long 			ret;
+
+	if (args->vrs_reserved != 0 ||
+			!is_verify_struct_valid((struct verification_struct *)args) ||
+			DIV_ROUND_UP(args->vrf_size, PAGE_SIZE) > VERIFICATOR_REGION_MAX_PAGES) {
 		return -EINVAL;
 	}
 
-	code_sz = args->vs.vrf_size;
-	code_addr = args->vs.vrf_addr;
+	scan.base = (const u8 *)args->vrf_addr;
+	scan.size = args->vrf_size;
+	scan.pages = DIV_ROUND_UP(scan.size, PAGE_SIZE);
+
+	args->vrs_page_size = PAGE_SIZE;
+	if ((args->vrs_page_hashes || args->vrs_expected) &&
+			args->vrs_page_count < scan.pages) {
+		args->vrs_page_count = scan.pages;
+		return -ENOSPC;
+	}
+	args->vrs_page_count = scan.pages;
 
-	code = kzalloc(code_sz, GFP_KERNEL);
-	if (code == NULL) {
-		printk(KERN_ERR "Cannot allocate memory for copying code\n");
+	scan.hashes = kvmalloc_array(scan.pages, sizeof(u32), GFP_KERNEL);
+	if (scan.hashes == NULL) {
 		return -ENOMEM;
 	}
 
-	memcpy((void*)code, (const void*)code_addr, code_sz);
+	if (args->vrs_expected) {
+		expected = kvmalloc_array(scan.pages, sizeof(u32), GFP_KERNEL);
+		if (expected == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (copy_from_user(expected, args->vrs_expected, scan.pages * sizeof(u32))) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	start = ktime_get_ns();
+	args->vrs_cpus = region_scan_run(&scan);
+	args->vrs_nsec = ktime_get_ns() - start;
+
+	for (i = 0; i < scan.pages; i++) {
+		merkle_push(&ms, scan.hashes[i]);
 
-	crc = crc16(0, code, code_sz);
-	if (crc != args->hash) {
-		printk(KERN_ERR "Functions signatures not compatible\n"
-			" expected [%u] gotted [%u]\n", args->hash, crc);
+		if (expected && expected[i] != scan.hashes[i]) {
+			size_t offset = (size_t)i << PAGE_SHIFT;
+
+			verificator_report_mismatch(args->vrf_addr + offset,
+					min_t(size_t, scan.size - offset, PAGE_SIZE),
+					VERIFICATOR_HASH_CRC32C, expected[i], scan.hashes[i],
+					VERIFICATOR_EVENT_REGION);
+			mismatches++;
+		}
 	}
+	args->vrs_root = merkle_root(&ms);
+	args->vrs_mismatches = mismatches;
 
-	kfree(code);
+	if (args->vrs_page_hashes &&
+			copy_to_user(args->vrs_page_hashes, scan.hashes, scan.pages * sizeof(u32))) {
+		ret = -EFAULT;
+		goto out;
+	}
 
-	return crc;
+	ret = mismatches;
+out:
+	kvfree(expected);
+	kvfree(scan.hashes);
+	return ret;
 }
 
 static long verificator_get_diff(struct verificator_get_diff_struct *args)
 {
-	unsigned long ret = 0;
+	u64 	      start = trace_start(verificator_diff);
 	unsigned long size;
 	void	      *code;
-	unsigned char *buf;
 
 	if (!is_verify_struct_valid((struct verification_struct *)args)) {
 		printk(KERN_ERR "Cannot verify args\n");
 		return -EINVAL;
 	}
 
-	size = args->vs.vrf_size+1;
+	size = args->vs.vrf_size;
 	code = (void*)args->vs.vrf_addr;
 
-	buf = kzalloc(size, GFP_KERNEL);
-	if (buf == NULL) {
-		printk(KERN_ERR "Cannot kzalloc buffer\n");
-		return -ENOMEM;
+	if (copy_to_user(args->vrd_code, code, size)) {
+		return -EFAULT;
+	}
+	trace_verificator_diff(args->vs.vrf_addr, size, size, 1, trace_duration(start));
+
+	return size;
+}
+
+struct diff_output {
+	void __user 	*buf;
+	size_t 		capacity;
+	size_t 		used;
+	unsigned int 	count;
+};
+
+static int diff_emit(struct diff_output *out, const u8 *live, unsigned int offset,
+			unsigned int length)
+{
+	struct verificator_diff_run run = {
+		.vdr_offset = offset,
+		.vdr_length = length,
+	};
+	size_t need = VERIFICATOR_DIFF_RUN_SIZE(length);
+
+	if (out->used + need <= out->capacity) {
+		if (copy_to_user(out->buf + out->used, &run, sizeof(run)) ||
+		    copy_to_user(out->buf + out->used + sizeof(run), live + offset, length)) {
+			return -EFAULT;
+		}
 	}
 
-	memcpy(buf, (void*)code, size);
+	out->used += need;
+	out->count++;
 
-	ret = access_process_vm_func(current, args->vrd_code, (void*)buf, size, 1);
-	printk(KERN_INFO "[%d] bytes of code copyed\n", ret);
-	kfree(buf);
+	return 0;
+}
 
-	return ret;
+#define VERIFICATOR_DIFF_CHUNK 		256
+#define VERIFICATOR_DIFF_MERGE_GAP 	sizeof(struct verificator_diff_run)
+
+/*
+ * Streams the expected bytes in small chunks, compares them with the live
+ * text and writes only the differing runs, straight from the text.
+ */
+static long verificator_diff(struct verificator_diff_struct *args)
+{
+	struct diff_output out = {
+		.buf = args->vrd_runs,
+		.capacity = args->vrd_runs_size,
+	};
+	u8 		expected[VERIFICATOR_DIFF_CHUNK];
+	u64 		start = trace_start(verificator_diff);
+	const u8 	*live;
+	size_t 		size;
+	size_t 		pos = 0;
+	size_t 		differ = 0;
+	long 		run_start = -1;
+	size_t 		run_end = 0;
+	int 		err;
+
+	if (!is_verify_struct_valid((struct verification_struct *)args) ||
+			args->vs.vrf_size > UINT_MAX) {
+		return -EINVAL;
+	}
+
+	live = (const u8 *)args->vs.vrf_addr;
+	size = args->vs.vrf_size;
+
+	while (pos < size) {
+		size_t chunk = min_t(size_t, size - pos, sizeof(expected));
+		size_t i;
+
+		if (copy_from_user(expected, args->vrd_expected + pos, chunk)) {
+			return -EFAULT;
+		}
+
+		for (i = 0; i < chunk; i++) {
+			if (expected[i] == live[pos + i]) {
+				continue;
+			}
+
+			differ++;
+			if (run_start >= 0 && pos + i - run_end < VERIFICATOR_DIFF_MERGE_GAP) {
+				run_end = pos + i + 1;
+				continue;
+			}
+
+			if (run_start >= 0) {
+				err = diff_emit(&out, live, run_start, run_end - run_start);
+				if (err) {
+					return err;
+				}
+			}
+			run_start = pos + i;
+			run_end = pos + i + 1;
+		}
+
+		pos += chunk;
+		cond_resched();
+	}
+
+	if (run_start >= 0) {
+		err = diff_emit(&out, live, run_start, run_end - run_start);
+		if (err) {
+			return err;
+		}
+	}
+
+	args->vrd_runs_size = out.used;
+	args->vrd_count = out.count;
+	trace_verificator_diff(args->vs.vrf_addr, size, differ, out.count, trace_duration(start));
+
+	return out.used > out.capacity ? -ENOSPC : differ;
 }
 
 void disable_write_protect(void)
@@ -139,13 +1421,51 @@ void enable_write_protect(void)
 #endif
 }
 
+/*
+ * Writes only the byte runs of @code that differ from @live and returns
+ * the number of bytes written. Write protection must already be off.
+ */
+static size_t restore_delta(u8 *live, const u8 *code, size_t size)
+{
+	size_t patched = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		size_t start;
+
+		if (live[i] == code[i]) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		while (i < size && live[i] != code[i]) {
+			i++;
+		}
+		memcpy(live + start, code + start, i - start);
+		patched += i - start;
+	}
+
+	return patched;
+}
+
+/*
+ * CR0.WP is per CPU: a writer must not migrate while it is cleared, and
+ * writers from different sessions take turns.
+ */
+static DEFINE_MUTEX(restore_lock);
+
+/* Code that does not fit a scratch buffer is restored piece by piece */
 static long verificator_restore(struct verificator_restore_struct *args)
 {
-	void 		*kcode;
-	void 	__user 	*ucode;
-	size_t  	code_sz	  = 0;
-	long		restore_addr = 0;
-	int		err;
+	u8 		*kcode;
+	const u8 __user *ucode;
+	size_t  	code_sz;
+	size_t 		done = 0;
+	long		restore_addr;
+	long 		ret = 0;
+	bool 		delta = args->vrr_flags & VERIFICATOR_RESTORE_DELTA;
+	u64 		start = trace_start(verificator_restore);
 
 	if (!is_verify_struct_valid((struct verification_struct *)args)) {
 		printk(KERN_ERR "Cannot verify args\n");
@@ -156,39 +1476,246 @@ static long verificator_restore(struct verificator_restore_struct *args)
 	code_sz = args->vs.vrf_size;
 	restore_addr = args->vs.vrf_addr;
 
-	kcode = kzalloc(code_sz, GFP_KERNEL);
-	if (kcode == NULL) {
-		printk(KERN_ERR "Cannot allocate memory for copying code\n");
-		return -ENOMEM;
+	kcode = scratch_get();
+
+	mutex_lock(&restore_lock);
+	while (done < code_sz) {
+		size_t chunk = min_t(size_t, code_sz - done, scratch_size);
+		u8 *live = (u8 *)restore_addr + done;
+
+		if (copy_from_user(kcode, ucode + done, chunk)) {
+			printk(KERN_ERR "Cannot copy code from user to kernel\n");
+			ret = -EFAULT;
+			break;
+		}
+
+		/* With DELTA intact code is left alone, write protection included */
+		if (!delta || memcmp(live, kcode, chunk) != 0) {
+			preempt_disable();
+			disable_write_protect();
+			if (delta) {
+				ret += restore_delta(live, kcode, chunk);
+			} else {
+				memcpy(live, kcode, chunk);
+			}
+			enable_write_protect();
+			preempt_enable();
+		}
+
+		done += chunk;
 	}
+	mutex_unlock(&restore_lock);
 
-	err = copy_from_user((void*)kcode, (const void*)ucode, code_sz);
-	if (err) {
-		printk(KERN_ERR "Cannot copy code from user to kernel\n");
-		kfree(kcode);
-		return err;
+	scratch_put(kcode);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	trace_verificator_restore(restore_addr, code_sz, delta ? ret : code_sz, args->vrr_flags,
+				trace_duration(start));
+	if (!delta || ret) {
+		printk_ratelimited(KERN_INFO "Restored [%zu] bytes at addr\n",
+				delta ? (size_t)ret : code_sz);
 	}
 
-	printk(KERN_INFO "Try to restore addr\n");
+	return ret;
+}
+
+static unsigned long restore_batch_max_bytes = 16 << 20;
+module_param(restore_batch_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(restore_batch_max_bytes, "Maximum code bytes in one restore batch");
+
+struct restore_batch {
+	struct verificator_restore_entry 	*entries;
+	unsigned int 				count;
+	unsigned int 				flags;
+	u8 					*code;
+};
+
+/* Runs on one CPU while every other CPU spins in stop_machine() */
+static int verificator_restore_batch_apply(void *data)
+{
+	struct restore_batch *batch = data;
+	u8 *code = batch->code;
+	unsigned int i;
+
 	disable_write_protect();
-	memcpy((void*)restore_addr, kcode, code_sz);
+	for (i = 0; i < batch->count; i++) {
+		struct verificator_restore_entry *entry = &batch->entries[i];
+
+		if (entry->vrr_result) {
+			continue;
+		}
+
+		if (batch->flags & VERIFICATOR_RESTORE_DELTA) {
+			entry->vrr_result = restore_delta((u8 *)entry->vrf_addr,
+							code, entry->vrf_size);
+		} else {
+			memcpy((void *)entry->vrf_addr, code, entry->vrf_size);
+		}
+		code += entry->vrf_size;
+	}
 	enable_write_protect();
-	printk(KERN_INFO "Restored addr\n");
 
-	kfree(kcode);
 	return 0;
 }
 
-static long verificator_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static bool restore_batch_dirty(struct restore_batch *batch)
+{
+	const u8 *code = batch->code;
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		struct verificator_restore_entry *entry = &batch->entries[i];
+
+		if (entry->vrr_result) {
+			continue;
+		}
+
+		if (memcmp((void *)entry->vrf_addr, code, entry->vrf_size) != 0) {
+			return true;
+		}
+		code += entry->vrf_size;
+	}
+
+	return false;
+}
+
+/*
+ * All patches are validated and copied in first, then applied together
+ * in one stop_machine() call so that no CPU runs half-restored text.
+ */
+static long verificator_restore_batch(struct verificator_restore_batch_struct *args)
+{
+	struct restore_batch batch = {
+		.count = args->vrrb_count,
+		.flags = args->vrrb_flags,
+	};
+	size_t 		total = 0;
+	size_t 		offset = 0;
+	unsigned int 	restored = 0;
+	unsigned int 	i;
+	long 		ret;
+
+	if (batch.count == 0 || batch.count > VERIFICATOR_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	batch.entries = kvmalloc_array(batch.count, sizeof(*batch.entries), GFP_KERNEL);
+	if (batch.entries == NULL) {
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(batch.entries, args->vrrb_entries,
+				batch.count * sizeof(*batch.entries))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		struct verificator_restore_entry *entry = &batch.entries[i];
+
+		entry->vrr_result = is_verify_struct_valid((struct verification_struct *)entry) ?
+					0 : -EINVAL;
+		if (entry->vrr_result) {
+			continue;
+		}
+
+		if (entry->vrf_size > restore_batch_max_bytes ||
+				check_add_overflow(total, entry->vrf_size, &total)) {
+			ret = -E2BIG;
+			goto out;
+		}
+	}
+
+	if (total > restore_batch_max_bytes) {
+		ret = -E2BIG;
+		goto out;
+	}
+
+	batch.code = kvmalloc(total ? total : 1, GFP_KERNEL);
+	if (batch.code == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		struct verificator_restore_entry *entry = &batch.entries[i];
+
+		if (entry->vrr_result) {
+			continue;
+		}
+
+		if (copy_from_user(batch.code + offset, entry->vrr_code, entry->vrf_size)) {
+			entry->vrr_result = -EFAULT;
+			continue;
+		}
+		offset += entry->vrf_size;
+		restored++;
+	}
+
+	/* With DELTA, intact code does not need the machine stopped at all */
+	if (restored && (!(batch.flags & VERIFICATOR_RESTORE_DELTA) ||
+				restore_batch_dirty(&batch))) {
+		u64 start = trace_start(verificator_restore);
+		u64 duration;
+
+		mutex_lock(&restore_lock);
+		ret = stop_machine(verificator_restore_batch_apply, &batch, NULL);
+		mutex_unlock(&restore_lock);
+		if (ret) {
+			goto out;
+		}
+		duration = trace_duration(start);
+
+		/* Every entry was written in the same window, they share its duration */
+		for (i = 0; start && i < batch.count; i++) {
+			struct verificator_restore_entry *entry = &batch.entries[i];
+
+			if (entry->vrr_result >= 0) {
+				trace_verificator_restore(entry->vrf_addr, entry->vrf_size,
+					batch.flags & VERIFICATOR_RESTORE_DELTA ?
+						entry->vrr_result : entry->vrf_size,
+					batch.flags, duration);
+			}
+		}
+		printk_ratelimited(KERN_INFO "Restore batch: %u regions in one window\n",
+				restored);
+	}
+
+	ret = copy_to_user(args->vrrb_entries, batch.entries,
+				batch.count * sizeof(*batch.entries)) ? -EFAULT : restored;
+
+out:
+	kvfree(batch.code);
+	kvfree(batch.entries);
+	return ret;
+}
+
+static long verificator_ioctl_dispatch(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int err;
 	switch(cmd) {
 		case VERIFICATOR_VERIFY_CODE: {
 			struct verificator_verify_struct args;
+			long ret;
 
 			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+			if (err) {
+				return err;
+			}
 
-			return err ? err : verificator_verify_code(&args);
+			ret = verificator_verify_code(&args);
+			if (ret == VERIFICATOR_MISMATCH) {
+				printk_ratelimited(KERN_ERR "Functions signatures not compatible\n"
+					" expected [%llx] gotted [%llx]\n", args.hash, args.vrf_actual);
+			}
+			if (ret >= 0 && copy_to_user((void __user*)arg, &args, sizeof(args))) {
+				return -EFAULT;
+			}
+
+			return ret;
 		}
 		case VERIFICATOR_GET_DIFF: {
 			struct verificator_get_diff_struct args;
@@ -204,16 +1731,125 @@ static long verificator_ioctl(struct file *file, unsigned int cmd, unsigned long
 
 			return err ? err : verificator_restore(&args);
 	 	}
+		case VERIFICATOR_VERIFY_BATCH: {
+			struct verificator_verify_batch_struct args;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+
+			return err ? err : verificator_verify_batch(&args);
+		}
+		case VERIFICATOR_GET_BLOCK_HASHES: {
+			struct verificator_block_hashes_struct args;
+			long ret;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+			if (err) {
+				return err;
+			}
+
+			ret = verificator_block_hashes(&args);
+			if ((ret >= 0 || ret == -ENOSPC) &&
+					copy_to_user((void __user*)arg, &args, sizeof(args))) {
+				return -EFAULT;
+			}
+
+			return ret;
+		}
+		case VERIFICATOR_DIFF: {
+			struct verificator_diff_struct args;
+			long ret;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+			if (err) {
+				return err;
+			}
+
+			ret = verificator_diff(&args);
+			if ((ret >= 0 || ret == -ENOSPC) &&
+					copy_to_user((void __user*)arg, &args, sizeof(args))) {
+				return -EFAULT;
+			}
+
+			return ret;
+		}
+		case VERIFICATOR_RESTORE_BATCH: {
+			struct verificator_restore_batch_struct args;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+
+			return err ? err : verificator_restore_batch(&args);
+		}
+		case VERIFICATOR_SCAN_REGION: {
+			struct verificator_region_scan_struct args;
+			long ret;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+			if (err) {
+				return err;
+			}
+
+			ret = verificator_scan_region(&args);
+			if ((ret >= 0 || ret == -ENOSPC) &&
+					copy_to_user((void __user*)arg, &args, sizeof(args))) {
+				return -EFAULT;
+			}
+
+			return ret;
+		}
+		case VERIFICATOR_LOAD_BASELINE: {
+			struct verificator_load_baseline_struct args;
+
+			err = copy_from_user(&args, (const void __user*)arg, sizeof(args));
+
+			return err ? err : verificator_load_baseline(&args);
+		}
 		default:
 			printk(KERN_ERR "Unrecornized code value");
 			return -EINVAL;
 	}
 }
 
+/* Statistics slot of a command, -1 for anything the dispatcher rejects */
+static int verificator_stat_op(unsigned int cmd)
+{
+	switch (cmd) {
+		case VERIFICATOR_VERIFY_CODE:
+		case VERIFICATOR_GET_DIFF:
+		case VERIFICATOR_RESTORE:
+		case VERIFICATOR_VERIFY_BATCH:
+		case VERIFICATOR_LOAD_BASELINE:
+		case VERIFICATOR_GET_BLOCK_HASHES:
+		case VERIFICATOR_DIFF:
+		case VERIFICATOR_RESTORE_BATCH:
+		case VERIFICATOR_SCAN_REGION:
+			return _IOC_NR(cmd);
+		default:
+			return -1;
+	}
+}
+
+static long verificator_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	u64 	start = ktime_get_ns();
+	int 	op = verificator_stat_op(cmd);
+	long 	ret;
+
+	ret = verificator_ioctl_dispatch(file, cmd, arg);
+
+	if (op >= 0) {
+		verificator_stats_account(op, ret, ktime_get_ns() - start);
+	}
+
+	return ret;
+}
+
 static struct file_operations verificator_fops = {
+	.owner 		= THIS_MODULE,
 	.open 		= verificator_open,
 	.release 	= verificator_release,
 	.unlocked_ioctl = verificator_ioctl,
+	.mmap 		= verificator_mmap,
+	.poll 		= verificator_poll,
 };
 
 static struct miscdevice verificator_dev = {
@@ -226,24 +1862,66 @@ static int __init initialize_verificator(void)
 {
 	int err;
 
-	access_process_vm_func = (access_process_vm_t)kallsyms_lookup_name("access_process_vm");
-	if (access_process_vm_func == 0) {
-		printk(KERN_ERR "Cannot get access_process_vm addr\n");
-		return -EINVAL;
+	err = verificator_ring_init();
+	if (err < 0) {
+		printk(KERN_ERR "Cannot allocate event ring\n");
+		return err;
+	}
+
+	region_wq = alloc_workqueue("verificator_region", 0, 0);
+	if (region_wq == NULL) {
+		printk(KERN_ERR "Cannot allocate region workqueue\n");
+		vfree(ring);
+		return -ENOMEM;
+	}
+
+	err = verificator_scratch_init();
+	if (err < 0) {
+		printk(KERN_ERR "Cannot allocate scratch buffers\n");
+		destroy_workqueue(region_wq);
+		vfree(ring);
+		return err;
 	}
 
 	err = misc_register(&verificator_dev);
 	if (err < 0) {
 		printk(KERN_ERR "Cannot register misc device\n");
+		verificator_scratch_exit();
+		destroy_workqueue(region_wq);
+		vfree(ring);
+		return err;
 	}
 
-	return err;
+	verificator_dirty_init();
+
+	/* Statistics are optional, the module works without debugfs */
+	verificator_debugfs = debugfs_create_dir("verificator", NULL);
+	debugfs_create_file("stats", 0400, verificator_debugfs, NULL, &verificator_stats_fops);
+
+	WRITE_ONCE(scan_ready, true);
+	verificator_schedule_scan(false);
+
+	return 0;
 }
 
 static void __exit deinitialize_verificator(void)
 {
-
+	debugfs_remove_recursive(verificator_debugfs);
 	misc_deregister(&verificator_dev);
+
+	WRITE_ONCE(scan_ready, false);
+	scan_interval_ms = 0;
+	cancel_delayed_work_sync(&scan_work);
+	verificator_dirty_exit();
+
+	mutex_lock(&baseline_lock);
+	baseline_clear();
+	mutex_unlock(&baseline_lock);
+	srcu_barrier(&baseline_srcu);
+
+	verificator_scratch_exit();
+	destroy_workqueue(region_wq);
+	vfree(ring);
 }
 
 module_init(initialize_verificator);
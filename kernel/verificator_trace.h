@@ -0,0 +1,110 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM verificator
+
+#if !defined(_VERIFICATOR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VERIFICATOR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Per-call events of the hot paths, under
+ * /sys/kernel/tracing/events/verificator/. The durations are only
+ * measured while the event is enabled, 0 otherwise.
+ */
+TRACE_EVENT(verificator_verify,
+
+	TP_PROTO(unsigned long addr, size_t size, unsigned int hash_algo,
+		 u64 expected, u64 actual, u64 duration),
+
+	TP_ARGS(addr, size, hash_algo, expected, actual, duration),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, 	addr)
+		__field(size_t, 	size)
+		__field(unsigned int, 	hash_algo)
+		__field(u64, 		expected)
+		__field(u64, 		actual)
+		__field(u64, 		duration)
+	),
+
+	TP_fast_assign(
+		__entry->addr 		= addr;
+		__entry->size 		= size;
+		__entry->hash_algo 	= hash_algo;
+		__entry->expected 	= expected;
+		__entry->actual 	= actual;
+		__entry->duration 	= duration;
+	),
+
+	TP_printk("addr=%lx size=%zu algo=%u expected=%llx actual=%llx %s duration=%lluns",
+		__entry->addr, __entry->size, __entry->hash_algo,
+		__entry->expected, __entry->actual,
+		__entry->expected == __entry->actual ? "ok" : "mismatch",
+		__entry->duration)
+);
+
+/* GET_DIFF copies the code out (differ = size), DIFF reports the runs */
+TRACE_EVENT(verificator_diff,
+
+	TP_PROTO(unsigned long addr, size_t size, size_t differ, unsigned int runs,
+		 u64 duration),
+
+	TP_ARGS(addr, size, differ, runs, duration),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, 	addr)
+		__field(size_t, 	size)
+		__field(size_t, 	differ)
+		__field(unsigned int, 	runs)
+		__field(u64, 		duration)
+	),
+
+	TP_fast_assign(
+		__entry->addr 		= addr;
+		__entry->size 		= size;
+		__entry->differ 	= differ;
+		__entry->runs 		= runs;
+		__entry->duration 	= duration;
+	),
+
+	TP_printk("addr=%lx size=%zu differ=%zu runs=%u duration=%lluns",
+		__entry->addr, __entry->size, __entry->differ, __entry->runs,
+		__entry->duration)
+);
+
+/* patched is the bytes written, all of size without RESTORE_DELTA */
+TRACE_EVENT(verificator_restore,
+
+	TP_PROTO(unsigned long addr, size_t size, size_t patched, unsigned int flags,
+		 u64 duration),
+
+	TP_ARGS(addr, size, patched, flags, duration),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, 	addr)
+		__field(size_t, 	size)
+		__field(size_t, 	patched)
+		__field(unsigned int, 	flags)
+		__field(u64, 		duration)
+	),
+
+	TP_fast_assign(
+		__entry->addr 		= addr;
+		__entry->size 		= size;
+		__entry->patched 	= patched;
+		__entry->flags 		= flags;
+		__entry->duration 	= duration;
+	),
+
+	TP_printk("addr=%lx size=%zu patched=%zu flags=%x duration=%lluns",
+		__entry->addr, __entry->size, __entry->patched, __entry->flags,
+		__entry->duration)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE verificator_trace
+#include <trace/define_trace.h>
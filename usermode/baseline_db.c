@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <verificator.h>
+#include "hash.h"
+#include "baseline_db.h"
+
+#define SQL_SCHEMA_VERSION "PRAGMA user_version"
+int baseline_schema_version(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int version = -1;
+
+	if (sqlite3_prepare_v2(db, SQL_SCHEMA_VERSION, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Ошибка чтения версии бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(stmt, 0);
+	}
+
+	sqlite3_finalize(stmt);
+	return version;
+}
+
+/*
+ * Decodes the legacy "15, 31, 68, ..." code column. Some old rows hold
+ * fewer bytes than their size column says, the entry is then cut down to
+ * the bytes that were actually recorded.
+ */
+static unsigned char *parse_code(const char *text, int *size)
+{
+	unsigned char 	*code;
+	char 		*end;
+	int 		j = 0;
+
+	code = malloc(*size);
+	if (code == NULL) {
+		fprintf(stderr, "Cannot alloc memory for code\n");
+		return NULL;
+	}
+
+	while (j < *size) {
+		long byte = strtol(text, &end, 10);
+
+		if (end == text) {
+			break;
+		}
+		code[j++] = (unsigned char)byte;
+		text = end + strspn(end, " ,");
+	}
+
+	if (j == 0) {
+		free(code);
+		return NULL;
+	}
+
+	if (j != *size) {
+		fprintf(stderr, "Code column holds %d bytes, size is %d\n", j, *size);
+		*size = j;
+	}
+
+	return code;
+}
+
+/* Result column of each verificator field in a statement, -1 if absent */
+enum baseline_column {
+	BASELINE_COL_ID,
+	BASELINE_COL_NAME,
+	BASELINE_COL_ADDRESS,
+	BASELINE_COL_SIZE,
+	BASELINE_COL_CODE,
+	BASELINE_COL_HASH,
+	BASELINE_COL_HASH_ALGO,
+	BASELINE_COL_BLOCK_HASHES,
+	BASELINE_COL_MERKLE_ROOT,
+	BASELINE_COL_MAX
+};
+
+static const char *baseline_column_names[BASELINE_COL_MAX] = {
+	[BASELINE_COL_ID] 		= "id",
+	[BASELINE_COL_NAME] 		= "name",
+	[BASELINE_COL_ADDRESS] 		= "address",
+	[BASELINE_COL_SIZE] 		= "size",
+	[BASELINE_COL_CODE] 		= "code",
+	[BASELINE_COL_HASH] 		= "hash",
+	[BASELINE_COL_HASH_ALGO] 	= "hash_algo",
+	[BASELINE_COL_BLOCK_HASHES] 	= "block_hashes",
+	[BASELINE_COL_MERKLE_ROOT] 	= "merkle_root",
+};
+
+struct baseline_stmt {
+	sqlite3_stmt 	*stmt;
+	int 		columns[BASELINE_COL_MAX];
+};
+
+static void baseline_map_columns(struct baseline_stmt *bs)
+{
+	int i, col;
+
+	for (col = 0; col < BASELINE_COL_MAX; col++) {
+		bs->columns[col] = -1;
+	}
+
+	for (i = 0; i < sqlite3_column_count(bs->stmt); i++) {
+		const char *name = sqlite3_column_name(bs->stmt, i);
+
+		for (col = 0; col < BASELINE_COL_MAX; col++) {
+			if (strcmp(name, baseline_column_names[col]) == 0) {
+				bs->columns[col] = i;
+			}
+		}
+	}
+}
+
+static inline bool baseline_has_column(const struct baseline_stmt *bs, int col)
+{
+	return bs->columns[col] >= 0 &&
+		sqlite3_column_type(bs->stmt, bs->columns[col]) != SQLITE_NULL;
+}
+
+static int baseline_read_entry(const struct baseline_stmt *bs, struct verification_entry *entry)
+{
+	sqlite3_stmt *stmt = bs->stmt;
+	const int *col = bs->columns;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->hash_algo = VERIFICATOR_HASH_CRC16;
+
+	if (baseline_has_column(bs, BASELINE_COL_ID)) {
+		entry->id = sqlite3_column_int(stmt, col[BASELINE_COL_ID]);
+	}
+	if (baseline_has_column(bs, BASELINE_COL_NAME)) {
+		entry->name = (const char *)sqlite3_column_text(stmt, col[BASELINE_COL_NAME]);
+	}
+	if (baseline_has_column(bs, BASELINE_COL_ADDRESS)) {
+		int i = col[BASELINE_COL_ADDRESS];
+
+		if (sqlite3_column_type(stmt, i) == SQLITE_INTEGER) {
+			entry->addr = (unsigned long)sqlite3_column_int64(stmt, i);
+		} else {
+			sscanf((const char *)sqlite3_column_text(stmt, i), "%lx", &entry->addr);
+		}
+	}
+	if (baseline_has_column(bs, BASELINE_COL_SIZE)) {
+		entry->size = sqlite3_column_int(stmt, col[BASELINE_COL_SIZE]);
+	}
+	if (baseline_has_column(bs, BASELINE_COL_HASH_ALGO)) {
+		entry->hash_algo = sqlite3_column_int(stmt, col[BASELINE_COL_HASH_ALGO]);
+	}
+	if (baseline_has_column(bs, BASELINE_COL_HASH)) {
+		entry->hash = (unsigned long long)sqlite3_column_int64(stmt, col[BASELINE_COL_HASH]);
+		entry->has_hash = true;
+	}
+
+	if (baseline_has_column(bs, BASELINE_COL_BLOCK_HASHES) &&
+			baseline_has_column(bs, BASELINE_COL_MERKLE_ROOT)) {
+		entry->block_hashes = sqlite3_column_blob(stmt, col[BASELINE_COL_BLOCK_HASHES]);
+		entry->block_count = sqlite3_column_bytes(stmt, col[BASELINE_COL_BLOCK_HASHES]) /
+					sizeof(unsigned int);
+		entry->merkle_root = (unsigned int)sqlite3_column_int64(stmt,
+					col[BASELINE_COL_MERKLE_ROOT]);
+	}
+
+	if (!baseline_has_column(bs, BASELINE_COL_CODE) || entry->size <= 0) {
+		return -1;
+	}
+
+	if (sqlite3_column_type(stmt, col[BASELINE_COL_CODE]) == SQLITE_BLOB) {
+		if (sqlite3_column_bytes(stmt, col[BASELINE_COL_CODE]) < entry->size) {
+			return -1;
+		}
+		entry->code = sqlite3_column_blob(stmt, col[BASELINE_COL_CODE]);
+	} else {
+		entry->code_buf = parse_code((const char *)sqlite3_column_text(stmt,
+						col[BASELINE_COL_CODE]), &entry->size);
+		entry->code = entry->code_buf;
+	}
+
+	return entry->code ? 0 : -1;
+}
+
+unsigned long long baseline_entry_hash(const struct verification_entry *entry, unsigned int algo)
+{
+	if (entry->has_hash && entry->hash_algo == algo) {
+		return entry->hash;
+	}
+
+	return verificator_hash(algo, entry->code, entry->size);
+}
+
+/* Steps a bound statement through callback and leaves it reset for reuse */
+static int baseline_run(sqlite3 *db, const struct baseline_stmt *bs, void *ctx,
+			verification_entry_cb callback)
+{
+	struct verification_entry entry;
+	int ret = 0;
+	int rc;
+
+	while ((rc = sqlite3_step(bs->stmt)) == SQLITE_ROW) {
+		if (baseline_read_entry(bs, &entry) != 0) {
+			printf("INVALID params code [%p] size [%d] addr [%lu]\n",
+					entry.code, entry.size, entry.addr);
+			free(entry.code_buf);
+			continue;
+		}
+
+		ret = callback(ctx, &entry);
+		free(entry.code_buf);
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	if (ret == 0 && rc != SQLITE_DONE) {
+		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+		ret = -1;
+	}
+
+	sqlite3_reset(bs->stmt);
+	sqlite3_clear_bindings(bs->stmt);
+	return ret;
+}
+
+int baseline_query(sqlite3 *db, const char *sql, void *ctx, verification_entry_cb callback)
+{
+	struct baseline_stmt bs;
+	int ret;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &bs.stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	baseline_map_columns(&bs);
+	ret = baseline_run(db, &bs, ctx, callback);
+
+	sqlite3_finalize(bs.stmt);
+	return ret;
+}
+
+/*
+ * Lookups used on every target are prepared once per database handle and
+ * kept until baseline_close(), so repeated queries only bind and step.
+ */
+enum baseline_cached_stmt {
+	BASELINE_STMT_ALL,
+	BASELINE_STMT_BY_ID,
+	BASELINE_STMT_BY_NAME,
+	BASELINE_STMT_BY_NAME_RANGE,
+	BASELINE_STMT_BY_ADDR_RANGE,
+	BASELINE_STMT_BY_ADDR_WRAP,
+	BASELINE_STMT_INSERT,
+	BASELINE_STMT_MAX
+};
+
+static const char *baseline_stmt_sql[BASELINE_STMT_MAX] = {
+	[BASELINE_STMT_ALL] 	= "SELECT * FROM verificator",
+	[BASELINE_STMT_BY_ID] 	= "SELECT * FROM verificator WHERE id = ?1",
+	[BASELINE_STMT_BY_NAME] = "SELECT * FROM verificator WHERE name = ?1",
+	[BASELINE_STMT_BY_NAME_RANGE] =
+		"SELECT * FROM verificator WHERE name >= ?1 AND name < ?2 ORDER BY name",
+	[BASELINE_STMT_BY_ADDR_RANGE] =
+		"SELECT * FROM verificator WHERE address BETWEEN ?1 AND ?2 ORDER BY address",
+	[BASELINE_STMT_BY_ADDR_WRAP] =
+		"SELECT * FROM verificator WHERE address >= ?1 OR address <= ?2",
+	[BASELINE_STMT_INSERT] =
+		"INSERT INTO verificator (name, address, size, code, hash, hash_algo,"
+		" block_hashes, merkle_root) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)",
+};
+
+static struct {
+	sqlite3 		*db;
+	struct baseline_stmt 	stmts[BASELINE_STMT_MAX];
+} baseline_cache;
+
+static void baseline_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < BASELINE_STMT_MAX; i++) {
+		sqlite3_finalize(baseline_cache.stmts[i].stmt);
+		baseline_cache.stmts[i].stmt = NULL;
+	}
+	baseline_cache.db = NULL;
+}
+
+static struct baseline_stmt *baseline_cached_stmt(sqlite3 *db, enum baseline_cached_stmt which)
+{
+	struct baseline_stmt *bs;
+
+	if (baseline_cache.db != db) {
+		baseline_cache_flush();
+		baseline_cache.db = db;
+	}
+
+	bs = &baseline_cache.stmts[which];
+	if (bs->stmt == NULL) {
+		if (sqlite3_prepare_v3(db, baseline_stmt_sql[which], -1,
+				SQLITE_PREPARE_PERSISTENT, &bs->stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+			bs->stmt = NULL;
+			return NULL;
+		}
+		baseline_map_columns(bs);
+	}
+
+	return bs;
+}
+
+int baseline_query_all(sqlite3 *db, void *ctx, verification_entry_cb callback)
+{
+	struct baseline_stmt *bs = baseline_cached_stmt(db, BASELINE_STMT_ALL);
+
+	return bs ? baseline_run(db, bs, ctx, callback) : -1;
+}
+
+int baseline_query_by_id(sqlite3 *db, int id, void *ctx, verification_entry_cb callback)
+{
+	struct baseline_stmt *bs = baseline_cached_stmt(db, BASELINE_STMT_BY_ID);
+
+	if (bs == NULL) {
+		return -1;
+	}
+
+	sqlite3_bind_int(bs->stmt, 1, id);
+	return baseline_run(db, bs, ctx, callback);
+}
+
+int baseline_query_by_name(sqlite3 *db, const char *name, void *ctx, verification_entry_cb callback)
+{
+	struct baseline_stmt *bs = baseline_cached_stmt(db, BASELINE_STMT_BY_NAME);
+
+	if (bs == NULL) {
+		return -1;
+	}
+
+	sqlite3_bind_text(bs->stmt, 1, name, -1, SQLITE_STATIC);
+	return baseline_run(db, bs, ctx, callback);
+}
+
+/*
+ * Prefix match as a half-open range [prefix, prefix with its last byte
+ * bumped) so the name index is used; LIKE/GLOB would need special
+ * collation to do the same.
+ */
+int baseline_query_by_name_prefix(sqlite3 *db, const char *prefix, void *ctx,
+					verification_entry_cb callback)
+{
+	struct baseline_stmt *bs;
+	char 	*upper;
+	size_t 	len = strlen(prefix);
+	int 	ret;
+
+	while (len > 0 && (unsigned char)prefix[len - 1] == 0xff) {
+		len--;
+	}
+	if (len == 0) {
+		return baseline_query_all(db, ctx, callback);
+	}
+
+	bs = baseline_cached_stmt(db, BASELINE_STMT_BY_NAME_RANGE);
+	if (bs == NULL) {
+		return -1;
+	}
+
+	upper = strndup(prefix, len);
+	if (upper == NULL) {
+		return -1;
+	}
+	upper[len - 1]++;
+
+	sqlite3_bind_text(bs->stmt, 1, prefix, -1, SQLITE_STATIC);
+	sqlite3_bind_text(bs->stmt, 2, upper, -1, SQLITE_STATIC);
+	ret = baseline_run(db, bs, ctx, callback);
+
+	free(upper);
+	return ret;
+}
+
+/*
+ * Addresses are stored as signed 64-bit integers, so kernel addresses
+ * sort correctly among themselves; a range crossing the sign bit turns
+ * into two index ranges.
+ */
+int baseline_query_by_addr_range(sqlite3 *db, unsigned long start, unsigned long end,
+					void *ctx, verification_entry_cb callback)
+{
+	struct baseline_stmt *bs;
+	bool wrap = (sqlite3_int64)start > (sqlite3_int64)end;
+
+	if (start > end) {
+		fprintf(stderr, "Невалидные параметры\n");
+		return -1;
+	}
+
+	if (baseline_schema_version(db) < BASELINE_SCHEMA_BLOB) {
+		fprintf(stderr, "Address lookups need schema version %d, run --migrate\n",
+				BASELINE_SCHEMA_BLOB);
+		return -1;
+	}
+
+	bs = baseline_cached_stmt(db, wrap ? BASELINE_STMT_BY_ADDR_WRAP :
+						BASELINE_STMT_BY_ADDR_RANGE);
+	if (bs == NULL) {
+		return -1;
+	}
+
+	sqlite3_bind_int64(bs->stmt, 1, (sqlite3_int64)start);
+	sqlite3_bind_int64(bs->stmt, 2, (sqlite3_int64)end);
+	return baseline_run(db, bs, ctx, callback);
+}
+
+int baseline_insert(sqlite3 *db, const struct verification_entry *entry)
+{
+	struct baseline_stmt *bs = baseline_cached_stmt(db, BASELINE_STMT_INSERT);
+	int rc;
+
+	if (bs == NULL) {
+		return -1;
+	}
+
+	sqlite3_bind_text(bs->stmt, 1, entry->name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(bs->stmt, 2, (sqlite3_int64)entry->addr);
+	sqlite3_bind_int(bs->stmt, 3, entry->size);
+	sqlite3_bind_blob(bs->stmt, 4, entry->code, entry->size, SQLITE_STATIC);
+	sqlite3_bind_int64(bs->stmt, 5, (sqlite3_int64)entry->hash);
+	sqlite3_bind_int(bs->stmt, 6, entry->hash_algo);
+	sqlite3_bind_blob(bs->stmt, 7, entry->block_hashes,
+			entry->block_count * sizeof(unsigned int), SQLITE_STATIC);
+	sqlite3_bind_int64(bs->stmt, 8, entry->merkle_root);
+
+	rc = sqlite3_step(bs->stmt);
+	sqlite3_reset(bs->stmt);
+	sqlite3_clear_bindings(bs->stmt);
+
+	if (rc == SQLITE_CONSTRAINT) {
+		return 1;
+	}
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Ошибка записи в бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return 0;
+}
+
+#define SQL_SELECT_REGION "SELECT * FROM regions WHERE name = ?1"
+int baseline_query_region(sqlite3 *db, const char *name, void *ctx, baseline_region_cb callback)
+{
+	struct baseline_region 	region;
+	sqlite3_stmt 		*stmt;
+	int 			ret = 0;
+	int 			rc;
+
+	if (baseline_schema_version(db) < BASELINE_SCHEMA_REGIONS) {
+		return 0;
+	}
+
+	if (sqlite3_prepare_v2(db, SQL_SELECT_REGION, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		region.name = (const char *)sqlite3_column_text(stmt, 0);
+		region.addr = (unsigned long)sqlite3_column_int64(stmt, 1);
+		region.size = (unsigned long)sqlite3_column_int64(stmt, 2);
+		region.page_size = sqlite3_column_int(stmt, 3);
+		region.page_hashes = sqlite3_column_blob(stmt, 4);
+		region.page_count = sqlite3_column_bytes(stmt, 4) / sizeof(unsigned int);
+		region.merkle_root = (unsigned int)sqlite3_column_int64(stmt, 5);
+
+		ret = callback(ctx, &region);
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	if (ret == 0 && rc != SQLITE_DONE) {
+		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+		ret = -1;
+	}
+
+	sqlite3_finalize(stmt);
+	return ret;
+}
+
+#define SQL_SAVE_REGION "INSERT OR REPLACE INTO regions VALUES (?, ?, ?, ?, ?, ?)"
+int baseline_save_region(sqlite3 *db, const struct baseline_region *region)
+{
+	sqlite3_stmt 	*stmt;
+	int 		rc;
+
+	if (baseline_schema_version(db) < BASELINE_SCHEMA_REGIONS) {
+		fprintf(stderr, "Regions need schema version %d, run --migrate\n",
+				BASELINE_SCHEMA_REGIONS);
+		return -1;
+	}
+
+	if (sqlite3_prepare_v2(db, SQL_SAVE_REGION, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Ошибка записи в бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	sqlite3_bind_text(stmt, 1, region->name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, (sqlite3_int64)region->addr);
+	sqlite3_bind_int64(stmt, 3, (sqlite3_int64)region->size);
+	sqlite3_bind_int(stmt, 4, region->page_size);
+	sqlite3_bind_blob(stmt, 5, region->page_hashes,
+			region->page_count * sizeof(unsigned int), SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 6, region->merkle_root);
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Ошибка записи в бд - [%s]\n", sqlite3_errmsg(db));
+	}
+
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+void baseline_close(sqlite3 *db)
+{
+	if (baseline_cache.db == db) {
+		baseline_cache_flush();
+	}
+
+	sqlite3_close(db);
+}
+
+#define SQL_CREATE_BLOB_TABLE 					\
+	"CREATE TABLE verificator_blob ("			\
+	"	id		INTEGER PRIMARY KEY,"		\
+	"	name		TEXT NOT NULL,"			\
+	"	address		INTEGER NOT NULL,"		\
+	"	size		INTEGER NOT NULL,"		\
+	"	code		BLOB NOT NULL,"			\
+	"	hash		INTEGER NOT NULL,"		\
+	"	hash_algo	INTEGER NOT NULL DEFAULT 0"	\
+	")"
+#define SQL_INSERT_BLOB "INSERT INTO verificator_blob VALUES (?, ?, ?, ?, ?, ?, ?)"
+#define SQL_SWAP_BLOB_TABLE 					\
+	"DROP TABLE verificator;"				\
+	"ALTER TABLE verificator_blob RENAME TO verificator;"
+#define SQL_ADD_BLOCKS 										\
+	"ALTER TABLE verificator ADD COLUMN block_hashes BLOB;"					\
+	"ALTER TABLE verificator ADD COLUMN merkle_root INTEGER;"				\
+	"UPDATE verificator SET block_hashes = verificator_block_hashes(code),"			\
+	"	merkle_root = verificator_merkle_root(code);"
+#define SQL_CREATE_REGIONS 				\
+	"CREATE TABLE IF NOT EXISTS regions ("		\
+	"	name		TEXT PRIMARY KEY,"	\
+	"	address		INTEGER NOT NULL,"	\
+	"	size		INTEGER NOT NULL,"	\
+	"	page_size	INTEGER NOT NULL,"	\
+	"	page_hashes	BLOB NOT NULL,"		\
+	"	merkle_root	INTEGER NOT NULL"	\
+	")"
+#define SQL_CREATE_INDEXES 								\
+	"CREATE UNIQUE INDEX IF NOT EXISTS verificator_name_idx ON verificator(name);"	\
+	"CREATE INDEX IF NOT EXISTS verificator_address_idx ON verificator(address);"
+
+static int baseline_migrate_entry(void *ctx, struct verification_entry *entry)
+{
+	sqlite3_stmt *insert = ctx;
+	int rc;
+
+	if (entry->id > 0) {
+		sqlite3_bind_int(insert, 1, entry->id);
+	} else {
+		sqlite3_bind_null(insert, 1);
+	}
+	sqlite3_bind_text(insert, 2, entry->name ? entry->name : "", -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(insert, 3, (sqlite3_int64)entry->addr);
+	sqlite3_bind_int(insert, 4, entry->size);
+	sqlite3_bind_blob(insert, 5, entry->code, entry->size, SQLITE_STATIC);
+	sqlite3_bind_int64(insert, 6, (sqlite3_int64)baseline_entry_hash(entry, entry->hash_algo));
+	sqlite3_bind_int(insert, 7, entry->hash_algo);
+
+	rc = sqlite3_step(insert);
+	sqlite3_reset(insert);
+	sqlite3_clear_bindings(insert);
+
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Unlike baseline_run(), which skips rows it cannot decode, any such row
+ * fails the migration: the old table is dropped afterwards.
+ */
+static int baseline_migrate_rows(sqlite3 *db, sqlite3_stmt *insert, char **err)
+{
+	struct baseline_stmt 		bs;
+	struct verification_entry 	entry;
+	int 				rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT * FROM verificator", -1, &bs.stmt, NULL);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	baseline_map_columns(&bs);
+
+	while ((rc = sqlite3_step(bs.stmt)) == SQLITE_ROW) {
+		if (baseline_read_entry(&bs, &entry) != 0) {
+			*err = sqlite3_mprintf("row %d cannot be decoded", entry.id);
+			free(entry.code_buf);
+			rc = SQLITE_ERROR;
+			break;
+		}
+
+		rc = baseline_migrate_entry(insert, &entry) ? SQLITE_ERROR : SQLITE_OK;
+		free(entry.code_buf);
+		if (rc != SQLITE_OK) {
+			break;
+		}
+	}
+
+	sqlite3_finalize(bs.stmt);
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/*
+ * Converts a legacy database to the BLOB layout: code is decoded once and
+ * stored as raw bytes next to its digest. Legacy rows have no hash_algo
+ * column and are read as CRC16, the new table gets the column.
+ */
+static int baseline_migrate_blob(sqlite3 *db, char **err)
+{
+	sqlite3_stmt 	*insert = NULL;
+	int 		rc;
+
+	rc = sqlite3_exec(db, SQL_CREATE_BLOB_TABLE, NULL, NULL, err);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_prepare_v2(db, SQL_INSERT_BLOB, -1, &insert, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = baseline_migrate_rows(db, insert, err);
+	}
+	sqlite3_finalize(insert);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(db, SQL_SWAP_BLOB_TABLE, NULL, NULL, err);
+	}
+
+	return rc;
+}
+
+/* SQL helpers so that block digests are filled in by a single UPDATE */
+static void sql_block_hashes(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const unsigned char 	*code = sqlite3_value_blob(argv[0]);
+	int 			size = sqlite3_value_bytes(argv[0]);
+	unsigned int 		*hashes;
+	unsigned int 		count;
+	unsigned int 		root;
+
+	count = (size + VERIFICATOR_BLOCK_SIZE - 1) / VERIFICATOR_BLOCK_SIZE;
+	hashes = malloc(count * sizeof(*hashes) + 1);
+	if (hashes == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+
+	root = block_hashes(code, size, VERIFICATOR_BLOCK_SIZE, hashes);
+	if (sqlite3_user_data(ctx)) {
+		sqlite3_result_int64(ctx, root);
+		free(hashes);
+	} else {
+		sqlite3_result_blob(ctx, hashes, count * sizeof(*hashes), free);
+	}
+}
+
+static int baseline_register_functions(sqlite3 *db)
+{
+	int rc;
+
+	rc = sqlite3_create_function(db, "verificator_block_hashes", 1,
+			SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_block_hashes, NULL, NULL);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "verificator_merkle_root", 1,
+			SQLITE_UTF8 | SQLITE_DETERMINISTIC, (void *)1, sql_block_hashes, NULL, NULL);
+	}
+
+	return rc;
+}
+
+#define SQL_HAS_TABLE "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'verificator'"
+
+/* Creates an empty database at BASELINE_SCHEMA_VERSION, migrates an existing one */
+int baseline_create(sqlite3 *db)
+{
+	sqlite3_stmt 	*stmt;
+	char 		*err = 0;
+	char 		*sql;
+	bool 		exists;
+	int 		rc;
+
+	if (sqlite3_prepare_v2(db, SQL_HAS_TABLE, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
+		return -1;
+	}
+	exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+
+	if (exists) {
+		return baseline_migrate(db);
+	}
+
+	sql = sqlite3_mprintf("BEGIN;"
+			SQL_CREATE_BLOB_TABLE ";"
+			"ALTER TABLE verificator_blob RENAME TO verificator;"
+			"ALTER TABLE verificator ADD COLUMN block_hashes BLOB;"
+			"ALTER TABLE verificator ADD COLUMN merkle_root INTEGER;"
+			SQL_CREATE_INDEXES
+			SQL_CREATE_REGIONS ";"
+			"PRAGMA user_version = %d;"
+			"COMMIT;", BASELINE_SCHEMA_VERSION);
+	rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+	sqlite3_free(sql);
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Ошибка создания бд - [%s]\n", err ? err : sqlite3_errmsg(db));
+		sqlite3_free(err);
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Brings the database up to BASELINE_SCHEMA_VERSION in one transaction */
+int baseline_migrate(sqlite3 *db)
+{
+	char 		*err = 0;
+	char 		*sql;
+	int 		version;
+	int 		rc;
+
+	version = baseline_schema_version(db);
+	if (version < 0) {
+		return -1;
+	}
+
+	if (version >= BASELINE_SCHEMA_VERSION) {
+		printf("Database is already at schema version %d\n", version);
+		return 0;
+	}
+
+	if (baseline_cache.db == db) {
+		baseline_cache_flush();
+	}
+
+	rc = sqlite3_exec(db, "BEGIN", NULL, NULL, &err);
+	if (rc == SQLITE_OK && version < BASELINE_SCHEMA_BLOB) {
+		rc = baseline_migrate_blob(db, &err);
+	}
+	if (rc == SQLITE_OK && version < BASELINE_SCHEMA_INDEXED) {
+		rc = sqlite3_exec(db, SQL_CREATE_INDEXES, NULL, NULL, &err);
+	}
+	if (rc == SQLITE_OK && version < BASELINE_SCHEMA_BLOCKS) {
+		rc = baseline_register_functions(db);
+	}
+	if (rc == SQLITE_OK && version < BASELINE_SCHEMA_BLOCKS) {
+		rc = sqlite3_exec(db, SQL_ADD_BLOCKS, NULL, NULL, &err);
+	}
+	if (rc == SQLITE_OK && version < BASELINE_SCHEMA_REGIONS) {
+		rc = sqlite3_exec(db, SQL_CREATE_REGIONS, NULL, NULL, &err);
+	}
+	if (rc == SQLITE_OK) {
+		sql = sqlite3_mprintf("PRAGMA user_version = %d", BASELINE_SCHEMA_VERSION);
+		rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+		sqlite3_free(sql);
+	}
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Ошибка миграции бд - [%s]\n", err ? err : sqlite3_errmsg(db));
+		sqlite3_free(err);
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	rc = sqlite3_exec(db, "COMMIT", NULL, NULL, &err);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Ошибка миграции бд - [%s]\n", err);
+		sqlite3_free(err);
+		return -1;
+	}
+
+	printf("Database migrated to schema version %d\n", BASELINE_SCHEMA_VERSION);
+	return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef VERIFICATOR_BASELINE_DB_H
+#define VERIFICATOR_BASELINE_DB_H
+
+#include <stdbool.h>
+#include <sqlite3.h>
+
+/*
+ * PRAGMA user_version of the baseline database:
+ *  0 - legacy layout, code is a TEXT list of decimal bytes, no stored hash
+ *  1 - code is a BLOB and hash holds the precomputed digest
+ *  2 - unique index on name and an index on address
+ *  3 - block_hashes/merkle_root: CRC32C of every VERIFICATOR_BLOCK_SIZE
+ *      bytes of code and their Merkle root
+ *  4 - regions table with the page digests of whole-section scans
+ */
+#define BASELINE_SCHEMA_LEGACY 	0
+#define BASELINE_SCHEMA_BLOB 	1
+#define BASELINE_SCHEMA_INDEXED 2
+#define BASELINE_SCHEMA_BLOCKS 	3
+#define BASELINE_SCHEMA_REGIONS 4
+#define BASELINE_SCHEMA_VERSION BASELINE_SCHEMA_REGIONS
+
+/*
+ * One row of the verificator table. name and code point into the
+ * statement and are only valid inside the callback, unless the legacy
+ * text code had to be decoded, which then lives in code_buf.
+ */
+struct verification_entry {
+	int 			id;
+	const char 		*name;
+	unsigned long 		addr;
+	int 			size;
+	const unsigned char 	*code;
+	unsigned long long 	hash;
+	unsigned int 		hash_algo;
+	bool 			has_hash;
+	const void 		*block_hashes; 	/* block_count unaligned u32 */
+	unsigned int 		block_count;
+	unsigned int 		merkle_root;
+	unsigned char 		*code_buf;
+};
+
+typedef int (*verification_entry_cb)(void *ctx, struct verification_entry *entry);
+
+/*
+ * Row of the regions table, see VERIFICATOR_SCAN_REGION. page_hashes
+ * points into the statement and is only valid inside the callback.
+ */
+struct baseline_region {
+	const char 		*name;
+	unsigned long 		addr;
+	unsigned long 		size;
+	unsigned int 		page_size;
+	const void 		*page_hashes; 	/* page_count unaligned u32 */
+	unsigned int 		page_count;
+	unsigned int 		merkle_root;
+};
+
+typedef int (*baseline_region_cb)(void *ctx, struct baseline_region *region);
+
+int baseline_schema_version(sqlite3 *db);
+int baseline_migrate(sqlite3 *db);
+int baseline_create(sqlite3 *db);
+int baseline_query(sqlite3 *db, const char *sql, void *ctx, verification_entry_cb callback);
+int baseline_query_all(sqlite3 *db, void *ctx, verification_entry_cb callback);
+int baseline_query_by_id(sqlite3 *db, int id, void *ctx, verification_entry_cb callback);
+int baseline_query_by_name(sqlite3 *db, const char *name, void *ctx, verification_entry_cb callback);
+int baseline_query_by_name_prefix(sqlite3 *db, const char *prefix, void *ctx,
+					verification_entry_cb callback);
+int baseline_query_by_addr_range(sqlite3 *db, unsigned long start, unsigned long end,
+					void *ctx, verification_entry_cb callback);
+/*
+ * Adds a row from name, addr, size, code, hash, hash_algo and the block
+ * digests of entry. Returns 1 when the name is already taken.
+ */
+int baseline_insert(sqlite3 *db, const struct verification_entry *entry);
+
+int baseline_query_region(sqlite3 *db, const char *name, void *ctx, baseline_region_cb callback);
+int baseline_save_region(sqlite3 *db, const struct baseline_region *region);
+
+/* Finalizes the cached statements of db and closes it */
+void baseline_close(sqlite3 *db);
+
+/*
+ * Digest of the entry with the given algorithm: the stored hash when it
+ * was made with that algorithm, computed from the code otherwise.
+ */
+unsigned long long baseline_entry_hash(const struct verification_entry *entry, unsigned int algo);
+
+#endif
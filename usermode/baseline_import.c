@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <verificator.h>
+#include "hash.h"
+#include "baseline_db.h"
+#include "baseline_import.h"
+#include "flat_baseline.h"
+
+/*
+ * Function found in the source. name and code point into the mapped
+ * image (or the loaded System.map), block_hashes into import_set.blocks.
+ */
+struct import_func {
+	const char 		*name;
+	unsigned long 		addr;
+	unsigned int 		size;
+	const unsigned char 	*code;
+	unsigned long long 	hash;
+	unsigned int 		*block_hashes;
+	unsigned int 		block_count;
+	unsigned int 		merkle_root;
+};
+
+struct import_set {
+	struct import_func 	*funcs;
+	size_t 			count;
+	size_t 			capacity;
+	unsigned int 		*blocks;
+};
+
+static int import_add(struct import_set *set, const char *name, unsigned long addr,
+			unsigned int size, const unsigned char *code)
+{
+	struct import_func *func;
+
+	if (set->count == set->capacity) {
+		size_t capacity = set->capacity ? set->capacity * 2 : 4096;
+		void *funcs = realloc(set->funcs, capacity * sizeof(*set->funcs));
+
+		if (funcs == NULL) {
+			fprintf(stderr, "Cannot alloc memory for import\n");
+			return -1;
+		}
+		set->funcs = funcs;
+		set->capacity = capacity;
+	}
+
+	func = &set->funcs[set->count++];
+	memset(func, 0, sizeof(*func));
+	func->name = name;
+	func->addr = addr;
+	func->size = size;
+	func->code = code;
+
+	return 0;
+}
+
+struct mapped_file {
+	const unsigned char 	*data;
+	size_t 			size;
+};
+
+static int map_file(const char *path, struct mapped_file *file)
+{
+	struct stat 	st;
+	int 		fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "Cannot import empty file %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	file->size = st.st_size;
+	file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file->data == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	madvise((void *)file->data, file->size, MADV_WILLNEED);
+	return 0;
+}
+
+static inline bool in_file(const struct mapped_file *file, unsigned long offset,
+				unsigned long len)
+{
+	return offset <= file->size && len <= file->size - offset;
+}
+
+/* STT_FUNC symbols with a size that lie inside an executable PROGBITS section */
+static int import_elf(const struct mapped_file *file, struct import_set *set)
+{
+	const Elf64_Ehdr 	*ehdr = (const Elf64_Ehdr *)file->data;
+	const Elf64_Shdr 	*shdrs;
+	unsigned int 		i;
+
+	if (file->size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64) {
+		fprintf(stderr, "Only x86-64 ELF images are supported\n");
+		return -1;
+	}
+
+	if (ehdr->e_shnum && ehdr->e_shentsize != sizeof(*shdrs)) {
+		fprintf(stderr, "Unexpected section header size %u\n", ehdr->e_shentsize);
+		return -1;
+	}
+	if (!in_file(file, ehdr->e_shoff, (unsigned long)ehdr->e_shnum * ehdr->e_shentsize)) {
+		fprintf(stderr, "Section headers are out of the file\n");
+		return -1;
+	}
+	shdrs = (const Elf64_Shdr *)(file->data + ehdr->e_shoff);
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		const Elf64_Shdr 	*symtab = &shdrs[i];
+		const Elf64_Shdr 	*strtab;
+		const Elf64_Sym 	*syms;
+		const char 		*names;
+		size_t 			count, j;
+
+		if (symtab->sh_type != SHT_SYMTAB || symtab->sh_link >= ehdr->e_shnum) {
+			continue;
+		}
+		strtab = &shdrs[symtab->sh_link];
+		if (!in_file(file, symtab->sh_offset, symtab->sh_size) ||
+				!in_file(file, strtab->sh_offset, strtab->sh_size)) {
+			fprintf(stderr, "Symbol table is out of the file\n");
+			return -1;
+		}
+
+		syms = (const Elf64_Sym *)(file->data + symtab->sh_offset);
+		count = symtab->sh_size / sizeof(*syms);
+
+		names = (const char *)file->data + strtab->sh_offset;
+
+		for (j = 0; j < count; j++) {
+			const Elf64_Sym 	*sym = &syms[j];
+			const Elf64_Shdr 	*sec;
+			unsigned long 		offset;
+
+			if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_size == 0 ||
+					sym->st_size > INT32_MAX ||
+					sym->st_shndx == SHN_UNDEF || sym->st_shndx >= ehdr->e_shnum ||
+					sym->st_name >= strtab->sh_size ||
+					memchr(names + sym->st_name, '\0',
+						strtab->sh_size - sym->st_name) == NULL) {
+				continue;
+			}
+
+			sec = &shdrs[sym->st_shndx];
+			if (sec->sh_type != SHT_PROGBITS || !(sec->sh_flags & SHF_EXECINSTR) ||
+					sym->st_value < sec->sh_addr ||
+					sym->st_value - sec->sh_addr > sec->sh_size ||
+					sym->st_size > sec->sh_size - (sym->st_value - sec->sh_addr)) {
+				continue;
+			}
+
+			offset = sec->sh_offset + (sym->st_value - sec->sh_addr);
+			if (!in_file(file, offset, sym->st_size)) {
+				continue;
+			}
+
+			if (import_add(set, names + sym->st_name,
+					sym->st_value, sym->st_size, file->data + offset) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int import_flat_entry(void *ctx, struct verification_entry *entry)
+{
+	return import_add(ctx, entry->name, entry->addr, entry->size, entry->code);
+}
+
+static int import_flat(const struct mapped_file *file, struct import_set *set)
+{
+	struct flat_baseline fb;
+
+	if (flat_baseline_attach(file->data, file->size, &fb) != 0) {
+		return -1;
+	}
+
+	return flat_baseline_query_all(&fb, set, import_flat_entry);
+}
+
+struct map_symbol {
+	const char 	*name;
+	unsigned long 	addr;
+};
+
+static int map_symbol_cmp(const void *a, const void *b)
+{
+	const struct map_symbol *l = a, *r = b;
+
+	return l->addr < r->addr ? -1 : l->addr > r->addr;
+}
+
+/*
+ * System.map has no sizes, a text symbol is taken to run up to the next
+ * symbol at a higher address. text is filled with the map contents and
+ * keeps the names alive.
+ */
+static int import_dump(const struct mapped_file *file, const struct import_source *src,
+			char **text, struct import_set *set)
+{
+	struct map_symbol 	*syms = NULL;
+	size_t 			count = 0, capacity = 0;
+	size_t 			len = 0;
+	unsigned long 		base = src->dump_base;
+	FILE 			*map;
+	char 			*line;
+	size_t 			i;
+	int 			ret = -1;
+
+	map = fopen(src->system_map, "r");
+	if (map == NULL) {
+		perror(src->system_map);
+		return -1;
+	}
+	if (getdelim(text, &len, '\0', map) < 0) {
+		fprintf(stderr, "Cannot read %s\n", src->system_map);
+		fclose(map);
+		return -1;
+	}
+	fclose(map);
+
+	for (line = strtok(*text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		unsigned long 	addr;
+		char 		type;
+		int 		name;
+
+		if (sscanf(line, "%lx %c %n", &addr, &type, &name) != 2 ||
+				line[name] == '\0') {
+			continue;
+		}
+		if (base == 0 && strcmp(line + name, "_stext") == 0) {
+			base = addr;
+		}
+		if (type != 't' && type != 'T') {
+			continue;
+		}
+
+		if (count == capacity) {
+			void *p;
+
+			capacity = capacity ? capacity * 2 : 4096;
+			p = realloc(syms, capacity * sizeof(*syms));
+			if (p == NULL) {
+				fprintf(stderr, "Cannot alloc memory for import\n");
+				goto out;
+			}
+			syms = p;
+		}
+		syms[count].name = line + name;
+		syms[count].addr = addr;
+		count++;
+	}
+
+	if (base == 0) {
+		fprintf(stderr, "No _stext in %s, give the dump base address\n",
+				src->system_map);
+		goto out;
+	}
+
+	qsort(syms, count, sizeof(*syms), map_symbol_cmp);
+
+	for (i = 0; i < count; i++) {
+		size_t next = i + 1;
+
+		while (next < count && syms[next].addr == syms[i].addr) {
+			next++;
+		}
+		if (next == count || syms[i].addr < base ||
+				!in_file(file, syms[i].addr - base, syms[next].addr - syms[i].addr)) {
+			continue;
+		}
+
+		if (import_add(set, syms[i].name, syms[i].addr, syms[next].addr - syms[i].addr,
+				file->data + (syms[i].addr - base)) != 0) {
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	free(syms);
+	return ret;
+}
+
+struct hash_pool {
+	struct import_set 	*set;
+	unsigned int 		hash_algo;
+	size_t 			next;
+};
+
+static void *hash_worker(void *arg)
+{
+	struct hash_pool *pool = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->set->count) {
+		struct import_func *func = &pool->set->funcs[i];
+
+		func->hash = verificator_hash(pool->hash_algo, func->code, func->size);
+		func->merkle_root = block_hashes(func->code, func->size,
+					VERIFICATOR_BLOCK_SIZE, func->block_hashes);
+	}
+
+	return NULL;
+}
+
+static int hash_functions(struct import_set *set, const struct import_source *src)
+{
+	struct hash_pool 	pool = { .set = set, .hash_algo = src->hash_algo };
+	pthread_t 		*threads;
+	unsigned int 		jobs = src->jobs;
+	unsigned int 		started;
+	size_t 			blocks = 0;
+	size_t 			i;
+
+	for (i = 0; i < set->count; i++) {
+		set->funcs[i].block_count = (set->funcs[i].size + VERIFICATOR_BLOCK_SIZE - 1) /
+						VERIFICATOR_BLOCK_SIZE;
+		blocks += set->funcs[i].block_count;
+	}
+
+	set->blocks = malloc(blocks * sizeof(*set->blocks) + 1);
+	if (set->blocks == NULL) {
+		fprintf(stderr, "Cannot alloc memory for import\n");
+		return -1;
+	}
+
+	blocks = 0;
+	for (i = 0; i < set->count; i++) {
+		set->funcs[i].block_hashes = set->blocks + blocks;
+		blocks += set->funcs[i].block_count;
+	}
+
+	if (jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
+	threads = calloc(jobs, sizeof(*threads));
+	if (threads == NULL) {
+		fprintf(stderr, "Cannot alloc memory for import\n");
+		return -1;
+	}
+
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, hash_worker, &pool) != 0) {
+			break;
+		}
+	}
+
+	/* Whatever the threads did not get to is finished here */
+	hash_worker(&pool);
+
+	while (started--) {
+		pthread_join(threads[started], NULL);
+	}
+
+	free(threads);
+	return 0;
+}
+
+/* Static functions may share a name, later ones are stored as name@addr */
+static int store_functions(sqlite3 *db, struct import_set *set, unsigned int hash_algo)
+{
+	char 	*err = 0;
+	size_t 	i;
+	int 	rc;
+
+	rc = sqlite3_exec(db, "BEGIN; DELETE FROM verificator;", NULL, NULL, &err);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Ошибка записи в бд - [%s]\n", err ? err : sqlite3_errmsg(db));
+		sqlite3_free(err);
+		return -1;
+	}
+
+	for (i = 0; i < set->count; i++) {
+		struct import_func 		*func = &set->funcs[i];
+		struct verification_entry 	entry = {
+			.name 		= func->name,
+			.addr 		= func->addr,
+			.size 		= func->size,
+			.code 		= func->code,
+			.hash 		= func->hash,
+			.hash_algo 	= hash_algo,
+			.has_hash 	= true,
+			.block_hashes 	= func->block_hashes,
+			.block_count 	= func->block_count,
+			.merkle_root 	= func->merkle_root,
+		};
+		char 	*alias = NULL;
+
+		rc = baseline_insert(db, &entry);
+		if (rc == 1) {
+			if (asprintf(&alias, "%s@%lx", func->name, func->addr) < 0) {
+				rc = -1;
+				break;
+			}
+			entry.name = alias;
+			rc = baseline_insert(db, &entry);
+			free(alias);
+		}
+		if (rc != 0) {
+			break;
+		}
+	}
+
+	if (rc != 0) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	rc = sqlite3_exec(db, "COMMIT", NULL, NULL, &err);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Ошибка записи в бд - [%s]\n", err ? err : sqlite3_errmsg(db));
+		sqlite3_free(err);
+		return -1;
+	}
+
+	return 0;
+}
+
+long baseline_import(sqlite3 *db, const struct import_source *src)
+{
+	struct mapped_file 	file;
+	struct import_set 	set = {0};
+	char 			*map_text = NULL;
+	long 			ret = -1;
+
+	if (baseline_create(db) != 0) {
+		return -1;
+	}
+
+	if (map_file(src->path, &file) != 0) {
+		return -1;
+	}
+
+	if (file.size >= sizeof(FLAT_BASELINE_MAGIC) - 1 &&
+			memcmp(file.data, FLAT_BASELINE_MAGIC, sizeof(FLAT_BASELINE_MAGIC) - 1) == 0) {
+		if (import_flat(&file, &set) != 0) {
+			goto out;
+		}
+	} else if (file.size >= SELFMAG && memcmp(file.data, ELFMAG, SELFMAG) == 0) {
+		if (import_elf(&file, &set) != 0) {
+			goto out;
+		}
+	} else if (src->system_map) {
+		if (import_dump(&file, src, &map_text, &set) != 0) {
+			goto out;
+		}
+	} else {
+		fprintf(stderr, "%s is not an ELF image, a raw dump needs --system-map\n",
+				src->path);
+		goto out;
+	}
+
+	if (set.count == 0) {
+		fprintf(stderr, "No functions found in %s\n", src->path);
+		goto out;
+	}
+
+	if (hash_functions(&set, src) != 0 || store_functions(db, &set, src->hash_algo) != 0) {
+		goto out;
+	}
+
+	ret = set.count;
+out:
+	free(set.blocks);
+	free(set.funcs);
+	free(map_text);
+	munmap((void *)file.data, file.size);
+	return ret;
+}
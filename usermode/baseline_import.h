@@ -0,0 +1,26 @@
+#ifndef VERIFICATOR_BASELINE_IMPORT_H
+#define VERIFICATOR_BASELINE_IMPORT_H
+
+#include <sqlite3.h>
+
+/*
+ * Source of a bulk import: an uncompressed vmlinux with its symbol table,
+ * a flat baseline, or a raw dump of kernel text together with the
+ * System.map it was taken from. A dump starts at dump_base, or at _stext
+ * when dump_base is 0.
+ */
+struct import_source {
+	const char 	*path;
+	const char 	*system_map;
+	unsigned long 	dump_base;
+	unsigned int 	hash_algo;
+	unsigned int 	jobs; 		/* hashing threads, 0 means one per CPU */
+};
+
+/*
+ * Replaces the verificator table with every function of the source, in a
+ * single transaction. Returns the number of functions stored or -1.
+ */
+long baseline_import(sqlite3 *db, const struct import_source *src);
+
+#endif
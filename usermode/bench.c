@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <verificator.h>
+#include "crc16.h"
+#include "hash.h"
+#include "baseline_db.h"
+#include "verificator_backend.h"
+#include <sqlite3.h>
+
+/*
+ * Micro benchmarks of the userspace hot paths and of the ioctl round
+ * trips. Every case runs for at least --time ms, doubling the iteration
+ * count until it does, and is reported as ns/op and GB/s on stdout and
+ * as one CSV row in --output so runs of different releases can be
+ * diffed. The ioctls go to the device, or with --backend to a stand-in;
+ * by default a random scratch image is served by the file backend.
+ */
+#define BENCH_DEFAULT_OUTPUT 	"bench.csv"
+#define BENCH_IMAGE_SIZE 	(4UL << 20)
+#define BENCH_DB_ROWS 		1024
+#define BENCH_CODE_SIZE 	256
+
+typedef void (*bench_op)(void *ctx);
+
+static unsigned long long 	bench_min_ns = 200000000ULL;
+static const char 		*bench_filter;
+static FILE 			*bench_csv;
+
+/* Results are folded in here so the compiler cannot drop an operation */
+static volatile unsigned long long bench_sink;
+
+static unsigned long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_run(const char *name, size_t bytes, bench_op op, void *ctx)
+{
+	unsigned long long 	elapsed;
+	unsigned long 		iterations = 1;
+	double 			ns_per_op;
+	double 			gb_per_s;
+
+	if (bench_filter && strstr(name, bench_filter) == NULL) {
+		return;
+	}
+
+	for (;;) {
+		unsigned long long start = bench_now();
+		unsigned long i;
+
+		for (i = 0; i < iterations; i++) {
+			op(ctx);
+		}
+		elapsed = bench_now() - start;
+
+		if (elapsed >= bench_min_ns) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	ns_per_op = (double)elapsed / iterations;
+	gb_per_s = bytes ? bytes / ns_per_op : 0;
+
+	printf("%-36s %12.1f ns/op", name, ns_per_op);
+	if (bytes) {
+		printf(" %9.3f GB/s", gb_per_s);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	if (bench_csv) {
+		fprintf(bench_csv, "%s,%zu,%lu,%.1f,%.4f\n", name, bytes, iterations,
+			ns_per_op, gb_per_s);
+	}
+}
+
+static void fill_random(unsigned char *buf, size_t size)
+{
+	unsigned long long x = 0x9e3779b97f4a7c15ULL;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x;
+	}
+}
+
+/* Hashing */
+
+struct hash_case {
+	const unsigned char 	*buf;
+	size_t 			size;
+	unsigned short 		(*crc16)(unsigned short, unsigned char const *, size_t);
+	unsigned int 		algo;
+};
+
+static void crc16_op(void *ctx)
+{
+	struct hash_case *hc = ctx;
+
+	bench_sink += hc->crc16(0, hc->buf, hc->size);
+}
+
+static void hash_op(void *ctx)
+{
+	struct hash_case *hc = ctx;
+
+	bench_sink += verificator_hash(hc->algo, hc->buf, hc->size);
+}
+
+static void bench_hashing(void)
+{
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536, 1 << 20 };
+	static const struct {
+		const char *name;
+		unsigned short (*fn)(unsigned short, unsigned char const *, size_t);
+	} impls[] = {
+		{ "crc16", 		crc16 },
+		{ "crc16_bytewise", 	crc16_bytewise },
+		{ "crc16_slice8", 	crc16_slice8 },
+		{ "crc16_clmul", 	crc16_clmul },
+	};
+	unsigned char 	*buf;
+	char 		name[64];
+	unsigned int 	i, j;
+
+	buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	if (buf == NULL) {
+		return;
+	}
+	fill_random(buf, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+	printf("crc16 dispatches to %s\n", crc16_impl_name());
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		/* Without PCLMULQDQ the folding variant would just fault */
+		if (impls[i].fn == crc16_clmul && strcmp(crc16_impl_name(), "pclmul") != 0) {
+			continue;
+		}
+
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			struct hash_case hc = { .buf = buf, .size = sizes[j], .crc16 = impls[i].fn };
+
+			snprintf(name, sizeof(name), "hash/%s/%zu", impls[i].name, sizes[j]);
+			bench_run(name, sizes[j], crc16_op, &hc);
+		}
+	}
+
+	for (i = VERIFICATOR_HASH_CRC32C; i < VERIFICATOR_HASH_MAX; i++) {
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			struct hash_case hc = { .buf = buf, .size = sizes[j], .algo = i };
+
+			snprintf(name, sizeof(name), "hash/%s/%zu", hash_algo_name(i), sizes[j]);
+			bench_run(name, sizes[j], hash_op, &hc);
+		}
+	}
+
+	free(buf);
+}
+
+/* Baseline reads */
+
+static int count_callback(void *ctx, struct verification_entry *entry)
+{
+	bench_sink += entry->code[entry->size - 1];
+	return 0;
+}
+
+static int exec_callback(void *ctx, int argc, char **argv, char **col_name)
+{
+	bench_sink += argc;
+	return 0;
+}
+
+struct db_case {
+	sqlite3 	*db;
+	char 		**sql; 		/* exec/query: one lookup per name */
+	char 		**names;
+	unsigned int 	count;
+	unsigned int 	next;
+	int 		id;
+};
+
+static void parse_op(void *ctx)
+{
+	struct db_case *dc = ctx;
+
+	baseline_query_by_id(dc->db, dc->id, NULL, count_callback);
+}
+
+static void exec_lookup_op(void *ctx)
+{
+	struct db_case *dc = ctx;
+
+	sqlite3_exec(dc->db, dc->sql[dc->next++ % dc->count], exec_callback, NULL, NULL);
+}
+
+static void query_lookup_op(void *ctx)
+{
+	struct db_case *dc = ctx;
+
+	baseline_query(dc->db, dc->sql[dc->next++ % dc->count], NULL, count_callback);
+}
+
+static void prepared_lookup_op(void *ctx)
+{
+	struct db_case *dc = ctx;
+
+	baseline_query_by_name(dc->db, dc->names[dc->next++ % dc->count], NULL, count_callback);
+}
+
+/* One row with size bytes of code, as a legacy text row or a BLOB */
+static sqlite3 *parse_db(size_t size, bool legacy)
+{
+	struct verification_entry 	entry = {0};
+	unsigned char 			*code;
+	sqlite3 			*db;
+	char 				*text, *pos;
+	char 				*sql;
+	size_t 				i;
+
+	code = malloc(size);
+	text = malloc(size * 5 + 1);
+	if (code == NULL || text == NULL || sqlite3_open(":memory:", &db) != SQLITE_OK) {
+		free(code);
+		free(text);
+		return NULL;
+	}
+	fill_random(code, size);
+
+	if (!legacy) {
+		baseline_create(db);
+		entry.name = "bench";
+		entry.addr = VERIFICATOR_IMAGE_BASE;
+		entry.size = size;
+		entry.code = code;
+		baseline_insert(db, &entry);
+		free(code);
+		free(text);
+		return db;
+	}
+
+	for (i = 0, pos = text; i < size; i++) {
+		pos += sprintf(pos, i ? ", %u" : "%u", code[i]);
+	}
+	sql = sqlite3_mprintf("CREATE TABLE verificator (id INTEGER, name TEXT, address TEXT,"
+			" size INTEGER, code TEXT);"
+			"INSERT INTO verificator VALUES (1, 'bench', '%lx', %d, %Q);",
+			VERIFICATOR_IMAGE_BASE, (int)size, text);
+	sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+
+	free(code);
+	free(text);
+	return db;
+}
+
+static void bench_parsing(void)
+{
+	static const size_t sizes[] = { BENCH_CODE_SIZE, 4096 };
+	char 		name[64];
+	unsigned int 	i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct db_case dc = { .id = 1 };
+
+		dc.db = parse_db(sizes[i], true);
+		if (dc.db) {
+			snprintf(name, sizeof(name), "parse/legacy_text/%zu", sizes[i]);
+			bench_run(name, sizes[i], parse_op, &dc);
+			baseline_close(dc.db);
+		}
+
+		dc.db = parse_db(sizes[i], false);
+		if (dc.db) {
+			snprintf(name, sizeof(name), "parse/blob/%zu", sizes[i]);
+			bench_run(name, sizes[i], parse_op, &dc);
+			baseline_close(dc.db);
+		}
+	}
+}
+
+static void bench_lookups(void)
+{
+	struct verification_entry 	entry = {0};
+	struct db_case 			dc = { .count = BENCH_DB_ROWS };
+	unsigned char 			code[BENCH_CODE_SIZE];
+	unsigned int 			i;
+
+	if (sqlite3_open(":memory:", &dc.db) != SQLITE_OK || baseline_create(dc.db) != 0) {
+		return;
+	}
+
+	dc.names = calloc(dc.count, sizeof(*dc.names));
+	dc.sql = calloc(dc.count, sizeof(*dc.sql));
+	if (dc.names == NULL || dc.sql == NULL) {
+		goto out;
+	}
+
+	fill_random(code, sizeof(code));
+	sqlite3_exec(dc.db, "BEGIN", NULL, NULL, NULL);
+	for (i = 0; i < dc.count; i++) {
+		if (asprintf(&dc.names[i], "bench_function_%u", i) < 0) {
+			dc.names[i] = NULL;
+			goto out;
+		}
+		entry.name = dc.names[i];
+		entry.addr = VERIFICATOR_IMAGE_BASE + i * sizeof(code);
+		entry.size = sizeof(code);
+		entry.code = code;
+		baseline_insert(dc.db, &entry);
+	}
+	sqlite3_exec(dc.db, "COMMIT", NULL, NULL, NULL);
+
+	/* Lookups walk the names in a scattered order */
+	for (i = 0; i < dc.count; i++) {
+		dc.sql[i] = sqlite3_mprintf("SELECT * FROM verificator WHERE name = %Q",
+						dc.names[(i * 7919) % dc.count]);
+	}
+
+	bench_run("db/exec_lookup", 0, exec_lookup_op, &dc);
+	dc.next = 0;
+	bench_run("db/query_lookup", 0, query_lookup_op, &dc);
+	dc.next = 0;
+	bench_run("db/prepared_lookup", 0, prepared_lookup_op, &dc);
+
+out:
+	for (i = 0; i < dc.count; i++) {
+		if (dc.names) {
+			free(dc.names[i]);
+		}
+		if (dc.sql) {
+			sqlite3_free(dc.sql[i]);
+		}
+	}
+	free(dc.names);
+	free(dc.sql);
+	baseline_close(dc.db);
+}
+
+/* Ioctl round trips */
+
+#define BENCH_BATCH 	64
+
+struct ioctl_case {
+	int 		vfd;
+	unsigned long 	cmd;
+	void 		*arg;
+	size_t 		arg_size;
+	void 		*scratch; 	/* pristine copy of arg, ioctls write to it */
+};
+
+static void ioctl_op(void *ctx)
+{
+	struct ioctl_case *ic = ctx;
+
+	memcpy(ic->arg, ic->scratch, ic->arg_size);
+	bench_sink += verificator_backend_ioctl(ic->vfd, ic->cmd, ic->arg);
+}
+
+static void bench_ioctl_case(const char *name, size_t bytes, int vfd, unsigned long cmd,
+				void *arg, size_t arg_size)
+{
+	struct ioctl_case ic = { .vfd = vfd, .cmd = cmd, .arg = arg, .arg_size = arg_size };
+
+	if (verificator_backend_ioctl(vfd, cmd, arg) < 0 && errno != ENOSPC) {
+		fprintf(stderr, "%s: %s, skipped\n", name, strerror(errno));
+		return;
+	}
+
+	ic.scratch = malloc(arg_size);
+	if (ic.scratch == NULL) {
+		return;
+	}
+	memcpy(ic.scratch, arg, arg_size);
+
+	bench_run(name, bytes, ioctl_op, &ic);
+	free(ic.scratch);
+}
+
+static void bench_ioctls(int vfd, long text)
+{
+	struct verificator_verify_struct 	verify = {0};
+	struct verificator_verify_entry 	entries[BENCH_BATCH];
+	struct verificator_verify_batch_struct 	batch = { .vrb_count = BENCH_BATCH,
+							  .vrb_entries = entries };
+	struct verificator_get_diff_struct 	get_diff = {0};
+	struct verificator_diff_struct 		diff = {0};
+	struct verificator_block_hashes_struct 	blocks = {0};
+	struct verificator_restore_struct 	restore = {0};
+	struct verificator_region_scan_struct 	scan = {0};
+	static unsigned char 			code[4096];
+	static unsigned char 			runs[4096];
+	static unsigned int 			hashes[4096 / VERIFICATOR_BLOCK_SIZE];
+	unsigned int 				i;
+
+	verify.vrf_addr = text;
+	verify.vrf_size = BENCH_CODE_SIZE;
+	verify.hash_algo = VERIFICATOR_HASH_CRC32C;
+	verificator_backend_ioctl(vfd, VERIFICATOR_VERIFY_CODE, &verify);
+	verify.hash = verify.vrf_actual;
+	bench_ioctl_case("ioctl/verify_code/256", BENCH_CODE_SIZE, vfd,
+			VERIFICATOR_VERIFY_CODE, &verify, sizeof(verify));
+
+	for (i = 0; i < BENCH_BATCH; i++) {
+		entries[i] = (struct verificator_verify_entry){
+			.vrf_addr = text + i * BENCH_CODE_SIZE,
+			.vrf_size = BENCH_CODE_SIZE,
+			.hash_algo = VERIFICATOR_HASH_CRC32C,
+		};
+	}
+	verificator_backend_ioctl(vfd, VERIFICATOR_VERIFY_BATCH, &batch);
+	for (i = 0; i < BENCH_BATCH; i++) {
+		entries[i].hash = entries[i].vrf_actual;
+	}
+	/* Entries are rewritten in place, which is fine once they all match */
+	bench_ioctl_case("ioctl/verify_batch/64x256", BENCH_BATCH * BENCH_CODE_SIZE, vfd,
+			VERIFICATOR_VERIFY_BATCH, &batch, sizeof(batch));
+
+	get_diff.vrf_addr = text;
+	get_diff.vrf_size = sizeof(code);
+	get_diff.vrd_code = code;
+	bench_ioctl_case("ioctl/get_diff/4096", sizeof(code), vfd,
+			VERIFICATOR_GET_DIFF, &get_diff, sizeof(get_diff));
+
+	diff.vrf_addr = text;
+	diff.vrf_size = sizeof(code);
+	diff.vrd_expected = code;
+	diff.vrd_runs = runs;
+	diff.vrd_runs_size = sizeof(runs);
+	bench_ioctl_case("ioctl/diff/4096", sizeof(code), vfd,
+			VERIFICATOR_DIFF, &diff, sizeof(diff));
+
+	blocks.vrf_addr = text;
+	blocks.vrf_size = sizeof(code);
+	blocks.vbh_count = sizeof(hashes) / sizeof(hashes[0]);
+	blocks.vbh_hashes = hashes;
+	bench_ioctl_case("ioctl/block_hashes/4096", sizeof(code), vfd,
+			VERIFICATOR_GET_BLOCK_HASHES, &blocks, sizeof(blocks));
+
+	/* The live bytes themselves: a delta restore of intact code writes nothing */
+	restore.vrf_addr = text;
+	restore.vrf_size = sizeof(code);
+	restore.vrr_code = code;
+	restore.vrr_flags = VERIFICATOR_RESTORE_DELTA;
+	bench_ioctl_case("ioctl/restore_delta/4096", sizeof(code), vfd,
+			VERIFICATOR_RESTORE, &restore, sizeof(restore));
+
+	scan.vrf_addr = text;
+	scan.vrf_size = 1 << 20;
+	bench_ioctl_case("ioctl/scan_region/1M", 1 << 20, vfd,
+			VERIFICATOR_SCAN_REGION, &scan, sizeof(scan));
+}
+
+/* Address of _stext, 0 when kallsyms hides it */
+static long kernel_text(void)
+{
+	unsigned long 	addr;
+	char 		type;
+	char 		sym[256];
+	FILE 		*f;
+	long 		text = 0;
+
+	f = fopen("/proc/kallsyms", "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	while (fscanf(f, "%lx %c %255s%*[^\n]", &addr, &type, sym) == 3) {
+		if (strcmp(sym, "_stext") == 0) {
+			text = addr;
+			break;
+		}
+	}
+	fclose(f);
+
+	return text;
+}
+
+static char *scratch_image(void)
+{
+	char 		path[] = "/tmp/verificator-bench-XXXXXX";
+	unsigned char 	*buf;
+	char 		*spec = NULL;
+	int 		fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Cannot create scratch image");
+		return NULL;
+	}
+
+	buf = malloc(BENCH_IMAGE_SIZE);
+	if (buf) {
+		fill_random(buf, BENCH_IMAGE_SIZE);
+		if (write(fd, buf, BENCH_IMAGE_SIZE) == BENCH_IMAGE_SIZE) {
+			spec = strdup(path);
+		}
+		free(buf);
+	}
+	close(fd);
+
+	if (spec == NULL) {
+		unlink(path);
+	}
+	return spec;
+}
+
+static void bench_device(const char *backend, long text)
+{
+	char 	*image = NULL;
+	char 	*spec = NULL;
+	int 	vfd;
+
+	if (backend == NULL) {
+		image = scratch_image();
+		if (image == NULL || asprintf(&spec, "file:%s", image) < 0) {
+			goto out;
+		}
+		backend = spec;
+		text = VERIFICATOR_IMAGE_BASE;
+	}
+
+	if (verificator_backend_set(backend) != 0) {
+		goto out;
+	}
+
+	if (text == 0 && verificator_backend_is_kernel()) {
+		text = kernel_text();
+	} else if (text == 0) {
+		char *path;
+		unsigned long base;
+
+		if (verificator_image_spec(backend + strlen("file:"), &path, &base) == 0) {
+			text = base;
+			free(path);
+		}
+	}
+	if (text == 0) {
+		fprintf(stderr, "No kernel text address, pass --text, ioctls skipped\n");
+		goto out;
+	}
+
+	vfd = verificator_backend_open("/dev/verificator");
+	if (vfd < 0) {
+		perror("Cannot open device, ioctls skipped");
+		goto out;
+	}
+
+	printf("ioctls against %s\n", backend);
+	bench_ioctls(vfd, text);
+	verificator_backend_close(vfd);
+
+out:
+	if (image) {
+		unlink(image);
+	}
+	free(image);
+	free(spec);
+}
+
+int main(int argc, char **argv)
+{
+	const char 	*output = BENCH_DEFAULT_OUTPUT;
+	const char 	*backend = getenv(VERIFICATOR_BACKEND_ENV);
+	long 		text = 0;
+	int 		c;
+	struct option bench_options[] = {
+		{"output", 1, 0, 'o'},
+		{"time", 1, 0, 't'},
+		{"filter", 1, 0, 'f'},
+		{"backend", 1, 0, 'k'},
+		{"text", 1, 0, 'T'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "o:t:f:k:T:", bench_options, NULL)) != -1) {
+		switch (c) {
+			case 'o':
+				output = optarg;
+				break;
+			case 't':
+				bench_min_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+				break;
+			case 'f':
+				bench_filter = optarg;
+				break;
+			case 'k':
+				backend = optarg;
+				break;
+			case 'T':
+				text = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [--output FILE] [--time MS] [--filter STR]"
+					" [--backend SPEC] [--text ADDR]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	bench_csv = fopen(output, "w");
+	if (bench_csv == NULL) {
+		perror(output);
+		return 1;
+	}
+	fprintf(bench_csv, "name,bytes,iterations,ns_per_op,gb_per_s\n");
+
+	bench_hashing();
+	bench_parsing();
+	bench_lookups();
+	bench_device(backend, text);
+
+	fclose(bench_csv);
+	printf("Results written to %s\n", output);
+
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,30 +8,49 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <verificator.h>
 #include "crc16.h"
+#include "hash.h"
+#include "baseline_db.h"
+#include "baseline_import.h"
+#include "flat_baseline.h"
+#include "verify_pipeline.h"
+#include "verificator_backend.h"
 #include <sqlite3.h>
 #include <getopt.h>
+#include <ctype.h>
 
 #define VERIFICATOR "/dev/verificator"
+#define VERIFICATOR_STATS "/sys/kernel/debug/verificator/stats"
 
-static inline unsigned short crc16_byte(unsigned short crc, const unsigned char data)
+/* Digest forced with --hash-algo, -1 to use the hash_algo column */
+static int hash_algo_override = -1;
+
+static unsigned int entry_hash_algo(const struct verification_entry *entry)
 {
-	return (crc >> 8) ^ crc16_table[(crc ^ data) & 0xff];
+	return hash_algo_override >= 0 ? hash_algo_override : entry->hash_algo;
 }
 
-unsigned short crc16(unsigned short crc, unsigned char const *buffer, size_t len)
+/* Baseline read from a --flat file instead of the database */
+static struct flat_baseline *flat_source;
+
+static int source_query_all(sqlite3 *db, void *ctx, verification_entry_cb callback)
 {
-	while (len--) {
-		crc = crc16_byte(crc, *buffer++);
+	if (flat_source) {
+		return flat_baseline_query_all(flat_source, ctx, callback);
 	}
 
-	return crc;
+	return baseline_query_all(db, ctx, callback);
 }
 
 static int verificator_open_device(const char *verificator)
 {
-	return open(verificator, O_RDWR);
+	return verificator_backend_open(verificator);
 }
 
 #define verificator_open() \
@@ -38,7 +58,7 @@ static int verificator_open_device(const char *verificator)
 
 static void verificator_release_device(int vfd)
 {
-	close(vfd);
+	verificator_backend_close(vfd);
 }
 
 #define verificator_close(fd) \
@@ -48,29 +68,27 @@ static bool verificator_verify_code(int vfd, struct verificator_verify_struct ar
 {
 	long ret;
 
-	printf("Try to verify function addr[%p] size %ul crc %u\n",
-		args.vrf_addr, args.vrf_size, args.hash);
+	printf("Try to verify function addr[%p] size %ul %s %llx\n",
+		args.vrf_addr, args.vrf_size, hash_algo_name(args.hash_algo), args.hash);
 
-	ret = ioctl(vfd, VERIFICATOR_VERIFY_CODE, &args);
+	ret = verificator_backend_ioctl(vfd, VERIFICATOR_VERIFY_CODE, &args);
 
-	printf("ret = %u, %s\n", (unsigned short)ret, ret == args.hash ? "true" : "false");
-	return ret == args.hash ? true : false;
+	printf("ret = %ld, gotted %llx, %s\n", ret, args.vrf_actual, ret == 0 ? "true" : "false");
+	return ret == 0 ? true : false;
 }
 
 #define verify_code(fd, ...)  \
 	verificator_verify_code(fd, (struct verificator_verify_struct){__VA_ARGS__})
 
-static void* verificator_get_diff(int vfd, struct verificator_get_diff_struct args)
+static long verificator_diff(int vfd, struct verificator_diff_struct *args)
 {
-	long ret;
-
-	ret = ioctl(vfd, VERIFICATOR_GET_DIFF, &args);
-
-	return ret != 0 ? args.vrd_code : NULL;
+	return verificator_backend_ioctl(vfd, VERIFICATOR_DIFF, args);
 }
 
-#define get_diff(fd, ...)  \
-	verificator_get_diff(fd, (struct verificator_get_diff_struct){__VA_ARGS__})
+static long verificator_get_block_hashes(int vfd, struct verificator_block_hashes_struct *args)
+{
+	return verificator_backend_ioctl(vfd, VERIFICATOR_GET_BLOCK_HASHES, args);
+}
 
 static long verificator_restore(int vfd, struct verificator_restore_struct args)
 {
@@ -79,7 +97,7 @@ static long verificator_restore(int vfd, struct verificator_restore_struct args)
 	printf("Try to verify function addr[%p] size %ul code [%p]\n",
 		args.vrf_addr, args.vrf_size, args.vrr_code);
 
-	ret = ioctl(vfd, VERIFICATOR_RESTORE, &args);
+	ret = verificator_backend_ioctl(vfd, VERIFICATOR_RESTORE, &args);
 
 	printf("ret = %u, %s\n", (unsigned short)ret, ret == 0 ? "true" : "false");
 
@@ -89,354 +107,1137 @@ static long verificator_restore(int vfd, struct verificator_restore_struct args)
 #define restore(fd, ...)  \
 	verificator_restore(fd, (struct verificator_restore_struct){__VA_ARGS__})
 
-static void print_header(int size)
+static long verificator_verify_batch(int vfd, struct verificator_verify_batch_struct args)
+{
+	return verificator_backend_ioctl(vfd, VERIFICATOR_VERIFY_BATCH, &args);
+}
+
+#define verify_batch(fd, ...)  \
+	verificator_verify_batch(fd, (struct verificator_verify_batch_struct){__VA_ARGS__})
+
+static long verificator_restore_batch(int vfd, struct verificator_restore_batch_struct args)
+{
+	return verificator_backend_ioctl(vfd, VERIFICATOR_RESTORE_BATCH, &args);
+}
+
+#define restore_batch(fd, ...)  \
+	verificator_restore_batch(fd, (struct verificator_restore_batch_struct){__VA_ARGS__})
+
+static long verificator_load_baseline(int vfd, struct verificator_load_baseline_struct args)
+{
+	return verificator_backend_ioctl(vfd, VERIFICATOR_LOAD_BASELINE, &args);
+}
+
+#define load_baseline(fd, ...)  \
+	verificator_load_baseline(fd, (struct verificator_load_baseline_struct){__VA_ARGS__})
+
+static void print_runs(const unsigned char *expected, unsigned long base,
+			const void *runs, unsigned int count)
+{
+	const unsigned char *ptr = runs;
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		const struct verificator_diff_run *run = (const void *)ptr;
+		const unsigned char *gotted = ptr + sizeof(*run);
+
+		printf("  +%#06lx %3u bytes  expected", base + run->vdr_offset, run->vdr_length);
+		for (j = 0; j < run->vdr_length; j++) {
+			printf(" %02x", expected[run->vdr_offset + j]);
+		}
+		printf("\n  %*s gotted  ", 17, "");
+		for (j = 0; j < run->vdr_length; j++) {
+			printf(" %02x", gotted[j]);
+		}
+		printf("\n");
+
+		ptr += VERIFICATOR_DIFF_RUN_SIZE(run->vdr_length);
+	}
+}
+
+/*
+ * Diffs [offset, offset + len) of the entry inside the kernel, growing
+ * the run buffer when the first guess is too small.
+ */
+static long diff_range(int vfd, const struct verification_entry *entry, int offset, int len)
+{
+	struct verificator_diff_struct args;
+	size_t 	runs_size = 256;
+	void 	*runs = NULL;
+	long 	ret;
+
+	do {
+		void *buf = realloc(runs, runs_size);
+
+		if (buf == NULL) {
+			fprintf(stderr, "Cannot alloc memory for diff runs\n");
+			free(runs);
+			return -1;
+		}
+		runs = buf;
+
+		args = (struct verificator_diff_struct){
+			.vrf_addr = entry->addr + offset,
+			.vrf_size = len,
+			.vrd_expected = entry->code + offset,
+			.vrd_runs = runs,
+			.vrd_runs_size = runs_size,
+		};
+		ret = verificator_diff(vfd, &args);
+		runs_size = args.vrd_runs_size;
+	} while (ret < 0 && errno == ENOSPC);
+
+	if (ret > 0) {
+		print_runs(entry->code + offset, offset, runs, args.vrd_count);
+	}
+
+	free(runs);
+	return ret;
+}
+
+static int get_verification_list_callback(void *ctx, struct verification_entry *entry)
+{
+	printf("|id : %d||name : %s||address : %#lx||size : %d||%s : %llx|\n",
+		entry->id, entry->name ? entry->name : "NULL", entry->addr,
+		entry->size, hash_algo_name(entry->hash_algo),
+		baseline_entry_hash(entry, entry->hash_algo));
+
+	return 0;
+}
+
+static int verify_code_callback(void *ctx, struct verification_entry *entry)
+{
+	unsigned int 	algo = entry_hash_algo(entry);
+	int 		vfd = *(int*)ctx;
+
+	printf("VALID params code [%p] size [%d] addr [%lu]\n",
+				entry->code, entry->size, entry->addr);
+	if (!verify_code(vfd,
+			.vrf_addr=entry->addr,
+			.vrf_size=entry->size,
+			.hash_algo=algo,
+			.hash=baseline_entry_hash(entry, algo)))
+	{
+		printf(" Function hash is not compatible!\n");
+	}
+
+	return 0;
+}
+
+static int restore_code_callback(void *ctx, struct verification_entry *entry)
 {
-	int i;
+	int 		vfd = *(int*)ctx;
+	int		ret = 0;
+
+	ret = restore(vfd, .vrf_addr=entry->addr,
+			   .vrf_size=entry->size,
+			   .vrr_code=(void*)entry->code);
+	if (ret != 0) {
+		printf("Cannot restore function!\n");
+		return -1;
+	}
+
+	return 0;
+}
 
-	for (i = 0; i < size*8; i++) {
-		printf("-");
+/*
+ * Compares per-block digests first and only diffs the ranges of blocks
+ * whose digest differs. The comparison itself runs in the kernel, which
+ * sends back just the differing byte runs.
+ */
+static int get_diff_callback(void *ctx, struct verification_entry *entry)
+{
+	struct verificator_block_hashes_struct bh;
+	unsigned int 	*expected;
+	unsigned int 	*actual;
+	unsigned int 	expected_root;
+	unsigned int 	count;
+	unsigned int 	i;
+	long 		differ = 0;
+	int 		vfd = *(int*)ctx;
+	int 		ret = -1;
+
+	count = (entry->size + VERIFICATOR_BLOCK_SIZE - 1) / VERIFICATOR_BLOCK_SIZE;
+	expected = malloc(count * sizeof(*expected));
+	actual = malloc(count * sizeof(*actual));
+	if (expected == NULL || actual == NULL) {
+		fprintf(stderr, "Cannot alloc memory for block hashes\n");
+		goto out;
 	}
-	printf("\n|");
-	for (i = 0; i < size*2; i++) {
-		printf(" ");
+
+	if (entry->block_hashes && entry->block_count == count) {
+		memcpy(expected, entry->block_hashes, count * sizeof(*expected));
+		expected_root = entry->merkle_root;
+	} else {
+		expected_root = block_hashes(entry->code, entry->size,
+						VERIFICATOR_BLOCK_SIZE, expected);
 	}
-	printf("EXPECTED");
-	for (i = 0; i < size*2 - 8; i++) {
-		printf(" ");
+
+	bh = (struct verificator_block_hashes_struct){
+		.vrf_addr = entry->addr,
+		.vrf_size = entry->size,
+		.vbh_block_size = VERIFICATOR_BLOCK_SIZE,
+		.vbh_count = count,
+		.vbh_hashes = actual,
+	};
+	if (verificator_get_block_hashes(vfd, &bh) < 0) {
+		printf("Cannot get memory difference!\n");
+		goto out;
 	}
-	printf("|");
-	for (i = 0; i < size*2; i++) {
-		printf(" ");
+
+	if (bh.vbh_root == expected_root) {
+		printf("%s [%#lx]: no differences\n", entry->name, entry->addr);
+		ret = 0;
+		goto out;
 	}
-	printf("GOTTED");
-	for (i = 0; i < size*2 - 6; i++) {
-		printf(" ");
+
+	printf("%s [%#lx]:\n", entry->name, entry->addr);
+	for (i = 0; i < count; i++) {
+		unsigned int first = i;
+		int offset, len;
+		long diff;
+
+		if (expected[i] == actual[i]) {
+			continue;
+		}
+
+		while (i + 1 < count && expected[i + 1] != actual[i + 1]) {
+			i++;
+		}
+
+		offset = first * VERIFICATOR_BLOCK_SIZE;
+		len = (i + 1) * VERIFICATOR_BLOCK_SIZE;
+		if (len > entry->size) {
+			len = entry->size;
+		}
+		len -= offset;
+
+		diff = diff_range(vfd, entry, offset, len);
+		if (diff < 0) {
+			printf("Cannot get memory difference!\n");
+			goto out;
+		}
+		differ += diff;
 	}
-	printf("\n");
-	for (i = 0; i < size*8; i++) {
-		printf("-");
+
+	printf("%s [%#lx]: %ld of %d bytes differ\n", entry->name, entry->addr,
+			differ, entry->size);
+	ret = 0;
+
+out:
+	free(expected);
+	free(actual);
+	return ret;
+}
+
+struct verify_batch {
+	struct verificator_verify_entry *entries;
+	char 		**names;
+	unsigned int 	count;
+	unsigned int 	capacity;
+};
+
+static int verify_batch_callback(void *ctx, struct verification_entry *entry)
+{
+	struct verify_batch *batch = ctx;
+	struct verificator_verify_entry *ve;
+
+	if (batch->count == batch->capacity) {
+		unsigned int capacity = batch->capacity ? batch->capacity * 2 : 64;
+		void *entries, *names;
+
+		entries = realloc(batch->entries, capacity * sizeof(*batch->entries));
+		if (entries != NULL) {
+			batch->entries = entries;
+		}
+		names = realloc(batch->names, capacity * sizeof(*batch->names));
+		if (names != NULL) {
+			batch->names = names;
+		}
+		if (entries == NULL || names == NULL) {
+			fprintf(stderr, "Cannot alloc memory for batch\n");
+			return -1;
+		}
+		batch->capacity = capacity;
 	}
+
+	ve = &batch->entries[batch->count];
+	ve->vrf_addr = entry->addr;
+	ve->vrf_size = entry->size;
+	ve->hash_algo = entry_hash_algo(entry);
+	ve->hash = baseline_entry_hash(entry, ve->hash_algo);
+	ve->vrf_actual = 0;
+	ve->vrf_result = 0;
+	batch->names[batch->count] = strdup(entry->name ? entry->name : "?");
+	batch->count++;
+
+	return 0;
 }
 
-static void print_footer(int size)
+static void verify_batch_free(struct verify_batch *batch)
 {
-	int i;
-	for (i = 0; i < size*8; i++) {
-		printf("-");
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		free(batch->names[i]);
 	}
+	free(batch->names);
+	free(batch->entries);
+	memset(batch, 0, sizeof(*batch));
 }
 
-static void print_diff(const unsigned char *expected, const unsigned char *gotted, int size)
+/*
+ * Verifies every entry of batch, printing the mismatches and errors.
+ * Returns the mismatch count, or -errno when a VERIFY_BATCH call fails.
+ */
+static long verify_batch_run(int vfd, struct verify_batch *batch)
 {
-	int i, j;
+	long 		mismatches = 0;
+	unsigned int 	done;
+	unsigned int 	i;
 
-	print_header(20);
-	for (i = 0; i < size; i+=j) {
-		int tail = size - j;
+	for (done = 0; done < batch->count; done += VERIFICATOR_BATCH_MAX) {
+		unsigned int chunk = batch->count - done;
+		long ret;
 
-		if (tail >= 20) {
-			tail = 20;
+		if (chunk > VERIFICATOR_BATCH_MAX) {
+			chunk = VERIFICATOR_BATCH_MAX;
 		}
 
-		for (j = 0; j < tail; j++) {
-			if (expected[i+j] != gotted[i+j]) {
-				printf("!");
-				printf("%02x ", expected[i+j]);
-			} else {
-				printf("%03x ", expected[i+j]);
-			}
-		}
-		printf(" | ");
-		for (j = 0; j < tail; j++) {
-			if (expected[i+j] != gotted[i+j]) {
-				printf("!");
-				printf("%02x ", gotted[i+j]);
-			} else {
-				printf("%03x ", gotted[i+j]);
-			}
+		ret = verify_batch(vfd, .vrb_count=chunk,
+				        .vrb_entries=&batch->entries[done]);
+		if (ret < 0) {
+			ret = -errno;
+			fprintf(stderr, "Batch verification failed [%ld]\n", ret);
+			return ret;
 		}
+		mismatches += ret;
+	}
 
-		printf("\n");
+	for (i = 0; i < batch->count; i++) {
+		struct verificator_verify_entry *ve = &batch->entries[i];
+
+		if (ve->vrf_result < 0) {
+			printf("%s [%p]: error %ld\n", batch->names[i],
+					(void *)ve->vrf_addr, ve->vrf_result);
+		} else if (ve->vrf_result == VERIFICATOR_MISMATCH) {
+			printf("%s [%p]: %s expected [%llx] gotted [%llx]\n",
+					batch->names[i], (void *)ve->vrf_addr,
+					hash_algo_name(ve->hash_algo),
+					ve->hash, ve->vrf_actual);
+		}
 	}
-	print_footer(20);
-	printf("\n");
+
+	return mismatches;
 }
 
-#define LINE_SIZE 20
-static void print_code(const char *label, const unsigned char *code, int size)
+static int verificator_verify_all(sqlite3 *db, int vfd)
 {
-	int i, j;
-	printf("\n");
-	print_footer(20);
-	printf("\n");
-	printf("%s\n", label);
-	printf("\n");
-	print_footer(20);
-	printf("\n");
+	struct verify_batch batch = {0};
+	long 		mismatches;
+	int 		rc;
+
+	rc = source_query_all(db, &batch, verify_batch_callback);
+	if (rc == 0) {
+		mismatches = verify_batch_run(vfd, &batch);
+		if (mismatches < 0) {
+			rc = -1;
+		} else {
+			printf("Verified %u functions, %ld mismatches\n", batch.count, mismatches);
+		}
+	}
 
-	for (i = 0; i < size; i+= j) {
-		int tail = size - j;
+	verify_batch_free(&batch);
+	return rc;
+}
 
-		if (tail >= 20) {
-			tail = 20;
-		}
+static void print_event(const struct verificator_event *ev)
+{
+	time_t 		sec = ev->vre_timestamp / 1000000000ULL;
+	struct tm 	tm;
+	char 		stamp[32];
+
+	localtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%F %T", &tm);
+
+	printf("%s.%09llu %s%s [%#llx] size %llu %s expected [%llx] gotted [%llx]\n",
+		stamp, ev->vre_timestamp % 1000000000ULL,
+		ev->vre_flags & VERIFICATOR_EVENT_SCAN ? "scan" :
+		ev->vre_flags & VERIFICATOR_EVENT_REGION ? "region" : "verify",
+		ev->vre_flags & VERIFICATOR_EVENT_PATCHED ? " (patched)" : "",
+		ev->vre_addr, ev->vre_size, hash_algo_name(ev->vre_hash_algo),
+		ev->vre_expected, ev->vre_actual);
+}
+
+/* Upper bound in ns of the bucket holding the given fraction of calls */
+static double stats_percentile(const unsigned long long *hist, unsigned int buckets,
+				unsigned long long calls, double fraction)
+{
+	unsigned long long seen = 0;
+	unsigned int i;
 
-		for (j = 0; j < tail; j++) {
-			printf("%02x ", code[i+j]);
+	for (i = 0; i < buckets; i++) {
+		seen += hist[i];
+		if (seen && seen >= fraction * calls) {
+			return (double)(2ULL << i);
 		}
-		printf("\n");
 	}
-	printf("\n");
-	print_footer(20);
-	printf("\n");
+
+	return 0;
 }
 
-static int get_verification_list_callback(void *entry, int argc, char **argv, char **azcolname)
+#define STATS_BUCKETS_MAX 	64
+
+/*
+ * Prints the counters the module keeps in debugfs: calls, failures and
+ * latency per operation, the percentiles coming from the log2 buckets
+ * so they are upper bounds.
+ */
+static int verificator_print_stats(const char *path)
 {
-	int i;
+	unsigned long long 	total_nsec = 0;
+	char 			line[2048];
+	FILE 			*f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	printf("%-14s %10s %8s %8s %10s %10s %10s %12s\n", "op", "calls", "errors",
+		"enomem", "avg us", "p50 us", "p99 us", "total ms");
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long 	hist[STATS_BUCKETS_MAX];
+		unsigned long long 	calls, errors, enomem, nsec, value;
+		unsigned int 		buckets = 0;
+		char 			op[32];
+		char 			*pos;
+		int 			n;
+
+		if (sscanf(line, "%31s calls %llu errors %llu enomem %llu nsec %llu hist%n",
+				op, &calls, &errors, &enomem, &nsec, &n) != 5) {
+			if (sscanf(line, "%31s %llu", op, &value) == 2) {
+				printf("%s: %llu\n", op, value);
+			}
+			continue;
+		}
+
+		for (pos = line + n; buckets < STATS_BUCKETS_MAX; buckets++) {
+			char *end;
 
-	for (i = 0; i < argc; i++) {
-		printf("|%s : %s|", azcolname[i], argv[i] ? argv[i] : "NULL");
+			hist[buckets] = strtoull(pos, &end, 10);
+			if (end == pos) {
+				break;
+			}
+			pos = end;
+		}
+
+		total_nsec += nsec;
+		if (calls == 0) {
+			continue;
+		}
+
+		printf("%-14s %10llu %8llu %8llu %10.1f %10.1f %10.1f %12.3f\n", op, calls,
+			errors, enomem, nsec / 1e3 / calls,
+			stats_percentile(hist, buckets, calls, 0.5) / 1e3,
+			stats_percentile(hist, buckets, calls, 0.99) / 1e3, nsec / 1e6);
 	}
-	printf("\n");
+	fclose(f);
 
+	printf("Time in the module: %.3f ms\n", total_nsec / 1e6);
 	return 0;
 }
 
-#define SQL_SELECT "SELECT * FROM verificator"
-static struct verification_entry *get_verification_list(const char *bd_file)
+/*
+ * Consumes the mismatch ring in place: records are printed straight from
+ * the shared mapping and handed back by publishing the new tail.
+ */
+static int verificator_watch(int vfd)
 {
-	sqlite3 *db = 0;
-	char *err = 0;
-	int rc = 0;
+	const struct verificator_ring_header 	*hdr;
+	const struct verificator_event 		*events;
+	unsigned int 	*tailp;
+	long 		page = sysconf(_SC_PAGESIZE);
+	size_t 		size;
+	unsigned int 	dropped;
+
+	if (!verificator_backend_is_kernel()) {
+		fprintf(stderr, "The event ring needs the kernel backend\n");
+		return -1;
+	}
 
-	rc = sqlite3_open(bd_file, &db);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Ошибка открытия/создания бд - [%s]\n", sqlite3_errmsg(db));
-		return NULL;
+	hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, vfd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("Cannot map event ring");
+		return -1;
 	}
+	size = hdr->vrh_tail_offset;
+	munmap((void *)hdr, page);
 
-	rc = sqlite3_exec(db, SQL_SELECT, get_verification_list_callback, 0, &err);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
-		sqlite3_free(err);
-		return NULL;
+	hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, vfd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("Cannot map event ring");
+		return -1;
+	}
+	tailp = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, vfd, size);
+	if (tailp == MAP_FAILED) {
+		perror("Cannot map event ring tail");
+		munmap((void *)hdr, size);
+		return -1;
 	}
+	events = (const struct verificator_event *)((char *)hdr + hdr->vrh_data_offset);
+	dropped = hdr->vrh_dropped;
 
+	printf("Watching %u-record event ring\n", hdr->vrh_mask + 1);
+	fflush(stdout);
 
-	sqlite3_free(err);
-	sqlite3_close(db);
-	return NULL;
-}
-
-static int verify_code_callback(void *entry, int argc, char **argv, char **azcolname)
-{
-	unsigned long 	addr = 0;
-	unsigned char 	*code;
-	int 		size = 0;
-	int 		vfd = *(int*)entry;
-	int 		i;
-
-	for (i = 0; i < argc; i++) {
-		if (strcmp(azcolname[i], "address") == 0) {
-			sscanf(argv[i], "%lx", &addr);
-		} else if (strcmp(azcolname[i], "size") == 0) {
-			sscanf(argv[i], "%d", &size);
-		} else if (strcmp(azcolname[i], "code") == 0) {
-			char *ptr;
-			char *pchr;
-			int j = 0;
-			code = malloc(size);
-			if (code == NULL) {
-				fprintf(stderr, "Cannot alloc memory for code\n");
-				return -1;
-			}
+	for (;;) {
+		struct pollfd 	pfd = { .fd = vfd, .events = POLLIN };
+		unsigned int 	head, tail;
 
-			pchr = strtok(argv[i], " ,");
-			while (pchr != NULL) {
-				code[j] = (unsigned char)strtol(pchr, &ptr, 10);
-				pchr = strtok(NULL, " ,");
-				j++;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			perror("poll");
+			break;
+		}
+
+		head = __atomic_load_n(&hdr->vrh_head, __ATOMIC_ACQUIRE);
+		tail = *tailp;
+		while (tail != head) {
+			print_event(&events[tail & hdr->vrh_mask]);
+			tail++;
 		}
+		__atomic_store_n(tailp, tail, __ATOMIC_RELEASE);
 
+		if (hdr->vrh_dropped != dropped) {
+			printf("%u events dropped\n", hdr->vrh_dropped - dropped);
+			dropped = hdr->vrh_dropped;
+		}
+		fflush(stdout);
 	}
 
-	if (code == NULL || size == 0 || addr == 0) {
-		printf("INVALID params code [%p] size [%d] addr [%lu]\n", code, size, addr);
+	munmap(tailp, page);
+	munmap((void *)hdr, size);
+	return -1;
+}
+
+struct text_image_writer {
+	int 		fd;
+	unsigned long 	base;
+	unsigned long 	written;
+};
+
+static int write_image_callback(void *ctx, struct verification_entry *entry)
+{
+	struct text_image_writer *writer = ctx;
+
+	if ((unsigned long)entry->addr < writer->base) {
+		fprintf(stderr, "%s [%p] is below the image base\n", entry->name,
+			(void *)entry->addr);
+		return 0;
+	}
+
+	if (pwrite(writer->fd, entry->code, entry->size,
+			(unsigned long)entry->addr - writer->base) != (ssize_t)entry->size) {
+		perror("Cannot write text image");
 		return -1;
 	}
+	writer->written++;
 
-	printf("VALID params code [%p] size [%d] addr [%lu]\n", code, size, addr);
-	if (!verify_code(vfd,
-			.vrf_addr=addr,
-			.vrf_size=size,
-			.hash=crc16(0, code, size)))
-	{
-		printf(" Function hash is not compatible!\n");
+	return 0;
+}
+
+/*
+ * Lays the baseline code out at its kernel addresses, giving the file
+ * backend an intact image of the text to serve.
+ */
+static int verificator_write_image(sqlite3 *db, const char *spec)
+{
+	struct text_image_writer writer = {0};
+	char 	*path;
+	int 	ret;
+
+	if (verificator_image_spec(spec, &path, &writer.base) != 0) {
+		return -1;
+	}
+
+	writer.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (writer.fd < 0) {
+		perror(path);
+		free(path);
+		return -1;
 	}
 
+	ret = source_query_all(db, &writer, write_image_callback);
+	close(writer.fd);
+	if (ret == 0) {
+		printf("Wrote %lu functions to %s\n", writer.written, path);
+	}
+	free(path);
+
+	return ret;
+}
+
+struct baseline_upload {
+	struct verificator_baseline_entry *entries;
+	unsigned int 	count;
+	unsigned int 	capacity;
+};
+
+static int baseline_upload_callback(void *ctx, struct verification_entry *entry)
+{
+	struct baseline_upload *upload = ctx;
+	struct verificator_baseline_entry *vbe;
+
+	if (upload->count == upload->capacity) {
+		unsigned int capacity = upload->capacity ? upload->capacity * 2 : 64;
+		void *entries;
+
+		entries = realloc(upload->entries, capacity * sizeof(*upload->entries));
+		if (entries == NULL) {
+			fprintf(stderr, "Cannot alloc memory for baseline\n");
+			return -1;
+		}
+		upload->entries = entries;
+		upload->capacity = capacity;
+	}
+
+	vbe = &upload->entries[upload->count++];
+	vbe->vrf_addr = entry->addr;
+	vbe->vrf_size = entry->size;
+	vbe->hash_algo = entry_hash_algo(entry);
+	vbe->hash = baseline_entry_hash(entry, vbe->hash_algo);
+
 	return 0;
 }
 
-static int restore_code_callback(void *entry, int argc, char **argv, char **azcolname)
+/*
+ * Replaces the kernel-resident baseline with the whole table, the module
+ * then keeps re-verifying it on its own every scan_interval_ms.
+ */
+static int verificator_upload_baseline(sqlite3 *db, int vfd)
 {
-	unsigned long 	addr = 0;
-	unsigned char 	*code;
-	void 		*diff;
-	int 		size = 0;
-	int 		vfd = *(int*)entry;
-	int		ret = 0;
-	int 		i;
-
-	for (i = 0; i < argc; i++) {
-		if (strcmp(azcolname[i], "address") == 0) {
-			sscanf(argv[i], "%lx", &addr);
-		} else if (strcmp(azcolname[i], "size") == 0) {
-			sscanf(argv[i], "%d", &size);
-		} else if (strcmp(azcolname[i], "code") == 0) {
-			char *ptr;
-			char *pchr;
-			int j = 0;
-			code = malloc(size);
-			if (code == NULL) {
-				fprintf(stderr, "Cannot alloc memory for code\n");
-				return -1;
-			}
+	struct baseline_upload upload = {0};
+	unsigned int 	done = 0;
+	long 		ret = 0;
 
-			pchr = strtok(argv[i], " ,");
-			while (pchr != NULL) {
-				code[j] = (unsigned char)strtol(pchr, &ptr, 10);
-				pchr = strtok(NULL, " ,");
-				j++;
-			}
+	if (source_query_all(db, &upload, baseline_upload_callback) != 0) {
+		free(upload.entries);
+		return -1;
+	}
+
+	do {
+		unsigned int chunk = upload.count - done;
+
+		if (chunk > VERIFICATOR_BATCH_MAX) {
+			chunk = VERIFICATOR_BATCH_MAX;
+		}
+
+		ret = load_baseline(vfd, .vrl_count=chunk,
+				 .vrl_flags=done == 0 ? VERIFICATOR_BASELINE_REPLACE : 0,
+				 .vrl_entries=&upload.entries[done]);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot load baseline [%ld]\n", ret);
+			break;
 		}
+		done += chunk;
+	} while (done < upload.count);
 
+	if (ret >= 0) {
+		printf("Loaded %ld baseline records into the kernel\n", ret);
 	}
 
-	if (code == NULL || size == 0 || addr == 0) {
-		printf("INVALID params code [%p] size [%d] addr [%lu]\n",
-							code, size, addr);
-		return -1;
+	free(upload.entries);
+	return ret < 0 ? -1 : 0;
+}
+
+static volatile sig_atomic_t daemon_reload;
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	if (sig == SIGHUP) {
+		daemon_reload = 1;
+	} else {
+		daemon_stop = 1;
 	}
+}
 
-	ret = restore(vfd, .vrf_addr=addr,
-			   .vrf_size=size,
-			   .vrr_code=(void*)code);
-	if (ret != 0) {
-		printf("Cannot restore function!\n");
-		free(code);
+/*
+ * (Re)reads the baseline into batch. A flat baseline is mapped again so a
+ * file replaced by --export-flat is picked up; on failure the previous
+ * baseline stays in use.
+ */
+static int daemon_load(sqlite3 *db, const char *flat_path, struct verify_batch *batch,
+			int vfd, bool upload)
+{
+	struct verify_batch fresh = {0};
+
+	if (flat_source && flat_path) {
+		struct flat_baseline next;
+
+		if (flat_baseline_open(flat_path, &next) != 0) {
+			return -1;
+		}
+		flat_baseline_close(flat_source);
+		*flat_source = next;
+	}
+
+	if (source_query_all(db, &fresh, verify_batch_callback) != 0) {
+		verify_batch_free(&fresh);
 		return -1;
 	}
 
+	verify_batch_free(batch);
+	*batch = fresh;
+
+	if (upload) {
+		verificator_upload_baseline(db, vfd);
+	}
+
+	printf("Baseline loaded: %u functions\n", batch->count);
 	return 0;
 }
 
-static int get_diff_callback(void *entry, int argc, char **argv, char **azcolname)
-{
-	unsigned long 	addr = 0;
-	unsigned char 	*code;
-	void 		*diff;
-	int 		size = 0;
-	int 		vfd = *(int*)entry;
-	int 		i;
-
-	for (i = 0; i < argc; i++) {
-		if (strcmp(azcolname[i], "address") == 0) {
-			sscanf(argv[i], "%lx", &addr);
-		} else if (strcmp(azcolname[i], "size") == 0) {
-			sscanf(argv[i], "%d", &size);
-		} else if (strcmp(azcolname[i], "code") == 0) {
-			char *ptr;
-			char *pchr;
-			int j = 0;
-			code = malloc(size);
-			if (code == NULL) {
-				fprintf(stderr, "Cannot alloc memory for code\n");
-				return -1;
-			}
+/*
+ * --daemon: one device fd and one baseline handle for the whole run. The
+ * baseline is read into a verify batch once and only again on SIGHUP, so
+ * every sweep costs just the VERIFY_BATCH ioctls. Runs in the foreground
+ * until SIGINT or SIGTERM; a failed sweep is logged and retried on the
+ * next interval unless the device itself is gone.
+ */
+/* Sweep errors that no later sweep can recover from */
+static bool daemon_fatal(long err)
+{
+	switch (err) {
+		case -EBADF:
+		case -ENODEV:
+		case -ENXIO:
+		case -ENOTTY:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static int verificator_daemon(sqlite3 *db, const char *flat_path, int vfd,
+				unsigned int interval, bool upload)
+{
+	struct verify_batch batch = {0};
+	struct sigaction sa = { .sa_handler = daemon_signal };
+
+	/* No SA_RESTART, a signal has to cut the sleep short */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (daemon_load(db, flat_path, &batch, vfd, upload) != 0) {
+		return -1;
+	}
+
+	while (!daemon_stop) {
+		struct timespec start, end, pause = { .tv_sec = interval };
+		time_t 		now;
+		char 		stamp[32];
+		long 		mismatches;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		mismatches = verify_batch_run(vfd, &batch);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		now = time(NULL);
+		strftime(stamp, sizeof(stamp), "%F %T", localtime(&now));
+
+		if (daemon_fatal(mismatches)) {
+			fprintf(stderr, "%s sweep failed: %s, stopping\n", stamp,
+					strerror(-mismatches));
+			verify_batch_free(&batch);
+			return -1;
+		}
+
+		/* Anything else, e.g. ENOMEM or EINTR, may clear by the next sweep */
+		if (mismatches < 0) {
+			printf("%s sweep failed: %s, retrying in %u s\n", stamp,
+				strerror(-mismatches), interval);
+		} else {
+			printf("%s sweep: %u functions, %ld mismatches in %.3f ms\n", stamp,
+				batch.count, mismatches,
+				(end.tv_sec - start.tv_sec) * 1e3 +
+				(end.tv_nsec - start.tv_nsec) / 1e6);
+		}
+		fflush(stdout);
+
+		while (!daemon_stop && !daemon_reload &&
+				nanosleep(&pause, &pause) != 0 && errno == EINTR);
 
-			pchr = strtok(argv[i], " ,");
-			while (pchr != NULL) {
-				code[j] = (unsigned char)strtol(pchr, &ptr, 10);
-				pchr = strtok(NULL, " ,");
-				j++;
+		if (daemon_reload) {
+			daemon_reload = 0;
+			if (daemon_load(db, flat_path, &batch, vfd, upload) != 0) {
+				fprintf(stderr, "Reload failed, keeping the previous baseline\n");
 			}
 		}
+	}
 
+	verify_batch_free(&batch);
+	return 0;
+}
+
+static int verificator_make_query_by_id(sqlite3 *db, int id, int vfd, verification_entry_cb callback)
+{
+	if (db == NULL || id < 0) {
+		fprintf(stderr, "Невалидные параметры\n");
+		return -1;
 	}
 
-	if (code == NULL || size == 0 || addr == 0) {
-		printf("INVALID params code [%p] size [%d] addr [%lu]\n",
-							code, size, addr);
+	return baseline_query_by_id(db, id, &vfd, callback);
+}
+
+static int verificator_make_query_by_name(sqlite3 *db, const char *name, int vfd, verification_entry_cb callback)
+{
+	if (db == NULL || name == NULL || name[0] == '\0') {
+		fprintf(stderr, "Невалидные параметры\n");
 		return -1;
 	}
 
-	print_code("EXPECTED", code, size);
-	diff = get_diff(vfd, .vrf_addr=addr,
-			     .vrf_size=size,
-			     .vrd_code=code);
-	if (diff == NULL) {
-		printf("Cannot get memory difference!\n");
-		free(code);
+	return baseline_query_by_name(db, name, &vfd, callback);
+}
+
+struct target_selector {
+	char 		*id;
+	char 		*name;
+	char 		*name_prefix;
+	bool 		addr_range;
+	unsigned long 	addr_start;
+	unsigned long 	addr_end;
+};
+
+static int parse_addr_range(const char *arg, struct target_selector *targets)
+{
+	char *end;
+
+	targets->addr_start = strtoul(arg, &end, 16);
+	if (end == arg || *end != ':') {
 		return -1;
 	}
 
-	print_code("GOTTED", code, size);
+	arg = end + 1;
+	targets->addr_end = strtoul(arg, &end, 16);
+	if (end == arg || *end != '\0' || targets->addr_start > targets->addr_end) {
+		return -1;
+	}
 
+	targets->addr_range = true;
 	return 0;
 }
 
-#define SQL_SELECT_WHERE_ID "SELECT * FROM verificator WHERE id=%d"
-static int verificator_make_query_by_id(sqlite3 *db, int id, int vfd, int (*callback)(void *, int, char **, char **))
+static int verificator_select_targets(sqlite3 *db, const struct target_selector *targets,
+					void *ctx, verification_entry_cb callback)
 {
-	char *sql_select_where_id;
-	char *err = 0;
-	int rc = 0;
+	if (targets->id) {
+		char *id_optp = targets->id;
 
-	if (db == NULL || id < 0) {
-		fprintf(stderr, "Невалидные параметры\n");
-		return -1;
+		while (isdigit(*id_optp++));
+
+		int len = strlen(targets->id);
+		if (id_optp - targets->id == len + 1) {
+			int id;
+			sscanf(targets->id, "%i", &id);
+			if (flat_source) {
+				return flat_baseline_query_by_id(flat_source, id, ctx, callback);
+			}
+			return baseline_query_by_id(db, id, ctx, callback);
+		}
+	} else if (targets->name) {
+		int len = strlen(targets->name);
+		if (len > 0 && len < 255) {
+			if (flat_source) {
+				return flat_baseline_query_by_name(flat_source, targets->name,
+								ctx, callback);
+			}
+			return baseline_query_by_name(db, targets->name, ctx, callback);
+		}
+	} else if (targets->name_prefix) {
+		if (flat_source) {
+			return flat_baseline_query_by_name_prefix(flat_source, targets->name_prefix,
+								ctx, callback);
+		}
+		return baseline_query_by_name_prefix(db, targets->name_prefix, ctx, callback);
+	} else if (targets->addr_range) {
+		if (flat_source) {
+			return flat_baseline_query_by_addr_range(flat_source, targets->addr_start,
+								targets->addr_end, ctx, callback);
+		}
+		return baseline_query_by_addr_range(db, targets->addr_start,
+						targets->addr_end, ctx, callback);
 	}
 
-	asprintf(&sql_select_where_id, SQL_SELECT_WHERE_ID, id);
+	fprintf(stderr, "Error! Cant verify code! Args is not correct\n");
+	return -1;
+}
 
-	rc = sqlite3_exec(db, sql_select_where_id, callback, &vfd, &err);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
-		sqlite3_free(err);
+static long verificator_scan_region(int vfd, struct verificator_region_scan_struct *args)
+{
+	return verificator_backend_ioctl(vfd, VERIFICATOR_SCAN_REGION, args);
+}
+
+/* Page digests of a stored region, copied out of the statement */
+struct region_baseline {
+	unsigned long 	addr;
+	unsigned long 	size;
+	unsigned int 	page_size;
+	unsigned int 	*hashes;
+	unsigned int 	count;
+};
+
+static int region_baseline_callback(void *ctx, struct baseline_region *region)
+{
+	struct region_baseline *rb = ctx;
+
+	rb->hashes = malloc(region->page_count * sizeof(*rb->hashes) + 1);
+	if (rb->hashes == NULL) {
+		fprintf(stderr, "Cannot alloc memory for region\n");
 		return -1;
 	}
+	memcpy(rb->hashes, region->page_hashes, region->page_count * sizeof(*rb->hashes));
+	rb->addr = region->addr;
+	rb->size = region->size;
+	rb->page_size = region->page_size;
+	rb->count = region->page_count;
 
-	sqlite3_free(err);
 	return 0;
 }
 
-#define SQL_SELECT_WHERE_NAME "SELECT * FROM verificator WHERE name LIKE '%s'"
-static int verificator_make_query_by_name(sqlite3 *db, const char *name, int vfd, int (*callback)(void *, int, char **, char **))
+/*
+ * Scans "text", "rodata" or a START:END range with the parallel in-kernel
+ * scanner and compares the page digests with the regions table, storing
+ * the result there with update.
+ */
+static int verificator_scan_region_by_spec(sqlite3 *db, int vfd, const char *spec, bool update)
 {
-	char *sql_select_where_name;
-	char *err = 0;
-	int rc = 0;
+	struct verificator_region_scan_struct args = {0};
+	struct region_baseline stored = {0};
+	unsigned int 	*hashes = NULL;
+	unsigned int 	i;
+	long 		ret;
+	int 		rc = -1;
+
+	if (strcmp(spec, "text") == 0 || strcmp(spec, "rodata") == 0) {
+		if (verificator_backend_section(spec, &args.vrf_addr, &args.vrf_size) != 0) {
+			return -1;
+		}
+	} else {
+		struct target_selector range = {0};
 
-	if (db == NULL || name == NULL || name[0] == '\0') {
-		fprintf(stderr, "Невалидные параметры\n");
+		if (parse_addr_range(spec, &range) != 0 || range.addr_start == range.addr_end) {
+			fprintf(stderr, "Bad region `%s', expected text, rodata or START:END\n",
+					spec);
+			return -1;
+		}
+		args.vrf_addr = range.addr_start;
+		args.vrf_size = range.addr_end - range.addr_start;
+	}
+
+	if (db && baseline_query_region(db, spec, &stored, region_baseline_callback) != 0) {
 		return -1;
 	}
 
-	asprintf(&sql_select_where_name, SQL_SELECT_WHERE_NAME, name);
+	/* Sized by the stored region, or by the kernel through -ENOSPC */
+	args.vrs_page_count = stored.count;
+	for (;;) {
+		hashes = malloc(args.vrs_page_count * sizeof(*hashes) + 1);
+		if (hashes == NULL) {
+			fprintf(stderr, "Cannot alloc memory for region\n");
+			goto out;
+		}
+		args.vrs_page_hashes = hashes;
 
-	rc = sqlite3_exec(db, sql_select_where_name, callback, &vfd, &err);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Ошибка выборки из бд - [%s]\n", sqlite3_errmsg(db));
-		sqlite3_free(err);
+		ret = verificator_scan_region(vfd, &args);
+		if (ret >= 0 || errno != ENOSPC) {
+			break;
+		}
+		free(hashes);
+		hashes = NULL;
+	}
+
+	if (ret < 0) {
+		perror("Cannot scan region");
+		goto out;
+	}
+
+	printf("Region %s [%#lx] size %zu: %u pages on %u CPUs in %.3f ms (%.2f GB/s), root [%08x]\n",
+		spec, args.vrf_addr, args.vrf_size, args.vrs_page_count, args.vrs_cpus,
+		args.vrs_nsec / 1e6, args.vrs_nsec ? (double)args.vrf_size / args.vrs_nsec : 0.0,
+		args.vrs_root);
+
+	if (stored.hashes == NULL) {
+		printf("No stored digests for region %s\n", spec);
+	} else if (stored.addr != (unsigned long)args.vrf_addr || stored.size != args.vrf_size ||
+			stored.page_size != args.vrs_page_size) {
+		printf("Region %s moved or changed size since it was stored\n", spec);
+	} else {
+		unsigned int mismatches = 0;
+
+		for (i = 0; i < args.vrs_page_count; i++) {
+			if (hashes[i] != stored.hashes[i]) {
+				printf("  page %u [%#lx] expected [%08x] gotted [%08x]\n", i,
+					args.vrf_addr + (unsigned long)i * args.vrs_page_size,
+					stored.hashes[i], hashes[i]);
+				mismatches++;
+			}
+		}
+		printf("Region %s: %u of %u pages differ\n", spec, mismatches,
+				args.vrs_page_count);
+	}
+
+	rc = 0;
+	if (update && db) {
+		struct baseline_region region = {
+			.name 		= spec,
+			.addr 		= args.vrf_addr,
+			.size 		= args.vrf_size,
+			.page_size 	= args.vrs_page_size,
+			.page_hashes 	= hashes,
+			.page_count 	= args.vrs_page_count,
+			.merkle_root 	= args.vrs_root,
+		};
+
+		rc = baseline_save_region(db, &region);
+		if (rc == 0) {
+			printf("Stored region %s\n", spec);
+		}
+	}
+
+out:
+	free(stored.hashes);
+	free(hashes);
+	return rc;
+}
+
+/*
+ * Restores every selected function with one RESTORE_BATCH ioctl, so the
+ * kernel patches them all in a single stop_machine() window. Code is
+ * copied out of the rows since their buffers only live for the callback.
+ */
+struct restore_batch {
+	struct verificator_restore_entry *entries;
+	char 		**names;
+	unsigned int 	count;
+	unsigned int 	capacity;
+};
+
+static int restore_batch_callback(void *ctx, struct verification_entry *entry)
+{
+	struct restore_batch *batch = ctx;
+	struct verificator_restore_entry *re;
+	void 		*code;
+
+	if (batch->count == batch->capacity) {
+		unsigned int capacity = batch->capacity ? batch->capacity * 2 : 64;
+		void *entries, *names;
+
+		entries = realloc(batch->entries, capacity * sizeof(*batch->entries));
+		if (entries != NULL) {
+			batch->entries = entries;
+		}
+		names = realloc(batch->names, capacity * sizeof(*batch->names));
+		if (names != NULL) {
+			batch->names = names;
+		}
+		if (entries == NULL || names == NULL) {
+			fprintf(stderr, "Cannot alloc memory for batch\n");
+			return -1;
+		}
+		batch->capacity = capacity;
+	}
+
+	code = malloc(entry->size ? entry->size : 1);
+	if (code == NULL) {
+		fprintf(stderr, "Cannot alloc memory for batch\n");
 		return -1;
 	}
+	memcpy(code, entry->code, entry->size);
+
+	re = &batch->entries[batch->count];
+	re->vrf_addr = entry->addr;
+	re->vrf_size = entry->size;
+	re->vrr_code = code;
+	re->vrr_result = 0;
+	batch->names[batch->count] = strdup(entry->name ? entry->name : "?");
+	batch->count++;
 
-	sqlite3_free(err);
 	return 0;
 }
 
+static int verificator_restore_selected(sqlite3 *db, const struct target_selector *targets,
+					bool all, unsigned int flags, int vfd)
+{
+	struct restore_batch batch = {0};
+	long 		restored = 0;
+	long 		patched = 0;
+	unsigned int 	done;
+	unsigned int 	i;
+	int 		rc;
+
+	if (all) {
+		rc = source_query_all(db, &batch, restore_batch_callback);
+	} else {
+		rc = verificator_select_targets(db, targets, &batch, restore_batch_callback);
+	}
+	if (rc != 0) {
+		goto out;
+	}
+
+	for (done = 0; done < batch.count; done += VERIFICATOR_BATCH_MAX) {
+		unsigned int chunk = batch.count - done;
+		long ret;
+
+		if (chunk > VERIFICATOR_BATCH_MAX) {
+			chunk = VERIFICATOR_BATCH_MAX;
+		}
+
+		ret = restore_batch(vfd, .vrrb_count=chunk,
+					 .vrrb_flags=flags,
+					 .vrrb_entries=&batch.entries[done]);
+		if (ret < 0) {
+			fprintf(stderr, "Batch restore failed [%ld]\n", ret);
+			rc = -1;
+			goto out;
+		}
+		restored += ret;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		struct verificator_restore_entry *re = &batch.entries[i];
+
+		if (re->vrr_result < 0) {
+			printf("%s [%p]: cannot restore, error %ld\n", batch.names[i],
+					(void *)re->vrf_addr, re->vrr_result);
+		} else if (re->vrr_result > 0) {
+			printf("%s [%p]: patched %ld bytes\n", batch.names[i],
+					(void *)re->vrf_addr, re->vrr_result);
+			patched += re->vrr_result;
+		}
+	}
+	printf("Restored %ld of %u functions\n", restored, batch.count);
+	if (flags & VERIFICATOR_RESTORE_DELTA) {
+		printf("Patched %ld bytes\n", patched);
+	}
+
+out:
+	for (i = 0; i < batch.count; i++) {
+		free((void *)batch.entries[i].vrr_code);
+		free(batch.names[i]);
+	}
+	free(batch.names);
+	free(batch.entries);
+	return rc;
+}
+
 static void test_verifying_code_by_id(void)
 {
 	sqlite3 *db = 0;
@@ -460,7 +1261,7 @@ static void test_verifying_code_by_id(void)
 
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -487,7 +1288,7 @@ static void test_get_different_code_by_id(void)
 	verificator_make_query_by_id(db, 1, vfd, get_diff_callback);
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -514,7 +1315,7 @@ static void test_restore_code_by_id(void)
 	verificator_make_query_by_id(db, 1, vfd, restore_code_callback);
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -542,7 +1343,7 @@ static void test_verifying_code_by_name(void)
 
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -569,7 +1370,7 @@ static void test_get_different_code_by_name(void)
 	verificator_make_query_by_name(db, "do_filp_open", vfd, get_diff_callback);
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -596,7 +1397,7 @@ static void test_restore_code_by_name(void)
 	verificator_make_query_by_name(db, "do_filp_open", vfd, restore_code_callback);
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
 
 	verificator_close(vfd);
 }
@@ -622,11 +1423,25 @@ int main(int argc, const char *argv[])
 	int 	verify_flag 	= 0;
 	int 	diff_flag 	= 0;
 	int 	restore_flag 	= 0;
-	int 	id_flag 	= 0;
-	char	*id_opt		= NULL;
-	int 	name_flag 	= 0;
-	char	*name_opt	= NULL;
+	struct target_selector targets = {0};
 	int 	list_flag 	= 0;
+	int 	all_flag 	= 0;
+	int 	migrate_flag 	= 0;
+	int 	load_flag 	= 0;
+	int 	watch_flag 	= 0;
+	int 	delta_flag 	= 0;
+	int 	update_region_flag = 0;
+	char 	*scan_region 	= NULL;
+	struct import_source import = {0};
+	struct flat_baseline flat = {0};
+	char 	*flat_path 	= NULL;
+	char 	*export_flat 	= NULL;
+	char 	*write_image 	= NULL;
+	char 	*backend 	= NULL;
+	int 	daemon_flag 	= 0;
+	int 	stats_flag 	= 0;
+	unsigned int interval 	= 60;
+	unsigned int jobs 	= 0;
 	int 	vfd;
 	int 	rc 		= 0;
 	int 	c;
@@ -635,11 +1450,34 @@ int main(int argc, const char *argv[])
 		{"verify", 0, 0, 'v'},
 		{"diff", 0, 0, 'd'},
 		{"restore", 0, 0, 'r'},
-		{"id", 0, 0, 'i'},
-		{"name", 0, 0, 'n'}
+		{"id", 1, 0, 'i'},
+		{"name", 1, 0, 'n'},
+		{"all", 0, 0, 'a'},
+		{"hash-algo", 1, 0, 'A'},
+		{"db", 1, 0, 'b'},
+		{"migrate", 0, 0, 'm'},
+		{"name-prefix", 1, 0, 'p'},
+		{"addr-range", 1, 0, 'R'},
+		{"load-baseline", 0, 0, 'L'},
+		{"watch", 0, 0, 'w'},
+		{"delta", 0, 0, 'D'},
+		{"scan-region", 1, 0, 'S'},
+		{"update-region", 0, 0, 'U'},
+		{"import", 1, 0, 'I'},
+		{"system-map", 1, 0, 'M'},
+		{"dump-base", 1, 0, 'B'},
+		{"flat", 1, 0, 'F'},
+		{"export-flat", 1, 0, 'E'},
+		{"daemon", 0, 0, 'Z'},
+		{"interval", 1, 0, 't'},
+		{"jobs", 1, 0, 'j'},
+		{"backend", 1, 0, 'k'},
+		{"write-image", 1, 0, 'W'},
+		{"stats", 0, 0, 's'},
+		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, (const char **)argv, "lvdri:n:",
+	while ((c = getopt_long(argc, (const char **)argv, "lvdri:n:aA:b:mp:R:LwDS:UI:M:B:F:E:Zt:j:k:W:s",
 			&verificator_options[0], NULL)) != EOF)
 	{
 		switch(c) {
@@ -660,18 +1498,101 @@ int main(int argc, const char *argv[])
 				printf("r opt\n");
 				break;
 			case 'i':
-				id_flag = 1;
 				if (optarg) {
-					id_opt = strdup(optarg);
+					targets.id = strdup(optarg);
 				}
-				printf("i opt %s %s\n", id_opt, optarg);
+				printf("i opt %s %s\n", targets.id, optarg);
 				break;
 			case 'n':
-				name_flag = 1;
 				if (optarg) {
-					name_opt = strdup(optarg);
+					targets.name = strdup(optarg);
+				}
+				printf("n opt %s\n", targets.name);
+				break;
+			case 'p':
+				targets.name_prefix = strdup(optarg);
+				printf("p opt %s\n", targets.name_prefix);
+				break;
+			case 'R':
+				if (parse_addr_range(optarg, &targets) != 0) {
+					fprintf(stderr, "Bad address range `%s', expected START:END\n",
+							optarg);
+					return 1;
+				}
+				break;
+			case 'a':
+				all_flag = 1;
+				printf("a opt\n");
+				break;
+			case 'A':
+				hash_algo_override = hash_algo_by_name(optarg);
+				if (hash_algo_override < 0) {
+					fprintf(stderr, "Unknown hash algo `%s'.\n", optarg);
+					return 1;
 				}
-				printf("n opt %s\n", name_opt);
+				break;
+			case 'b':
+				bd = strdup(optarg);
+				break;
+			case 'm':
+				migrate_flag = 1;
+				printf("m opt\n");
+				break;
+			case 'L':
+				load_flag = 1;
+				printf("L opt\n");
+				break;
+			case 'w':
+				watch_flag = 1;
+				printf("w opt\n");
+				break;
+			case 'D':
+				delta_flag = 1;
+				printf("D opt\n");
+				break;
+			case 'S':
+				scan_region = strdup(optarg);
+				printf("S opt %s\n", scan_region);
+				break;
+			case 'U':
+				update_region_flag = 1;
+				printf("U opt\n");
+				break;
+			case 'I':
+				import.path = strdup(optarg);
+				printf("I opt %s\n", import.path);
+				break;
+			case 'M':
+				import.system_map = strdup(optarg);
+				break;
+			case 'B':
+				import.dump_base = strtoul(optarg, NULL, 16);
+				break;
+			case 'F':
+				flat_path = strdup(optarg);
+				break;
+			case 'E':
+				export_flat = strdup(optarg);
+				break;
+			case 'Z':
+				daemon_flag = 1;
+				printf("Z opt\n");
+				break;
+			case 't':
+				interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				jobs = strtoul(optarg, NULL, 10);
+				import.jobs = jobs;
+				break;
+			case 'k':
+				backend = optarg;
+				break;
+			case 'W':
+				write_image = optarg;
+				break;
+			case 's':
+				stats_flag = 1;
 				break;
 			case '?':
 				if (isprint (c)) {
@@ -687,93 +1608,134 @@ int main(int argc, const char *argv[])
 		}
 	}
 
+	if (flat_path) {
+		if (flat_baseline_open(flat_path, &flat) != 0) {
+			return 1;
+		}
+		flat_source = &flat;
+	}
+
+	/* A flat baseline alone is enough to list, verify and restore */
+	if (!flat_source || import.path || migrate_flag || export_flat || update_region_flag) {
+		rc = sqlite3_open(bd, &db);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "Ошибка открытия/создания бд - [%s]\n", sqlite3_errmsg(db));
+			return rc;
+		}
+	}
+
+	if (migrate_flag && baseline_migrate(db) != 0) {
+		baseline_close(db);
+		return 1;
+	}
+
+	if (import.path) {
+		long imported;
+
+		import.hash_algo = hash_algo_override >= 0 ? hash_algo_override :
+							VERIFICATOR_HASH_CRC32C;
+		imported = baseline_import(db, &import);
+		if (imported < 0) {
+			baseline_close(db);
+			return 1;
+		}
+		printf("Imported %ld functions from %s\n", imported, import.path);
+	}
+
+	if (export_flat && flat_baseline_export(db, export_flat) != 0) {
+		baseline_close(db);
+		return 1;
+	}
+
+	if (write_image && verificator_write_image(db, write_image) != 0) {
+		baseline_close(db);
+		return 1;
+	}
+
 	if (list_flag) {
-		get_verification_list(bd);
+		if (targets.id || targets.name || targets.name_prefix || targets.addr_range) {
+			verificator_select_targets(db, &targets, NULL, get_verification_list_callback);
+		} else {
+			source_query_all(db, NULL, get_verification_list_callback);
+		}
+	}
+
+	if (!verify_flag && !diff_flag && !restore_flag && !load_flag && !watch_flag &&
+			!scan_region && !daemon_flag) {
+		if (stats_flag) {
+			verificator_print_stats(VERIFICATOR_STATS);
+		}
+		baseline_close(db);
+		return 0;
+	}
+
+	if (verificator_backend_set(backend ? backend : getenv(VERIFICATOR_BACKEND_ENV)) != 0) {
+		baseline_close(db);
+		return 1;
 	}
 
 	vfd = verificator_open();
 	if (vfd < 0) {
 		printf("Cannot open device! fd == %d\n", vfd);
+		baseline_close(db);
 		return vfd;
 	}
 
-	rc = sqlite3_open(bd, &db);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Ошибка открытия/создания бд - [%s]\n", sqlite3_errmsg(db));
-		return rc;
+	/* The daemon uploads the baseline itself, again on every reload */
+	if (load_flag && !daemon_flag) {
+		verificator_upload_baseline(db, vfd);
 	}
 
-	if (verify_flag) {
-		if (id_flag && id_opt) {
-			char *id_optp = id_opt;
-
-			while (isdigit(*id_optp++));
+	if (verify_flag && jobs > 1) {
+		struct verify_pipeline *pipeline;
 
-			int len = strlen(id_opt);
-			if (id_optp - id_opt == len + 1) {
-				int id;
-				sscanf(id_opt, "%i", &id);
-				verificator_make_query_by_id(db, id, vfd, verify_code_callback);
-			}
-		} else if (name_flag && name_opt) {
-			int len = strlen(name_opt);
-			if (len > 0 && len < 255) {
-				verificator_make_query_by_name(db, name_opt,
-								vfd, verify_code_callback);
+		pipeline = verify_pipeline_start(VERIFICATOR, jobs, hash_algo_override);
+		if (pipeline) {
+			if (all_flag) {
+				source_query_all(db, pipeline, verify_pipeline_push);
+			} else {
+				verificator_select_targets(db, &targets, pipeline,
+							verify_pipeline_push);
 			}
+			verify_pipeline_finish(pipeline);
+		}
+	} else if (verify_flag) {
+		if (all_flag) {
+			verificator_verify_all(db, vfd);
 		} else {
-			fprintf(stderr, "Error! Cant verify code! Args is not correct\n");
+			verificator_select_targets(db, &targets, &vfd, verify_code_callback);
 		}
 	}
 
 	if (diff_flag) {
-		if (id_flag && id_opt) {
-			char *id_optp = id_opt;
+		verificator_select_targets(db, &targets, &vfd, get_diff_callback);
+	}
 
-			while (isdigit(*id_optp++));
+	if (restore_flag) {
+		verificator_restore_selected(db, &targets, all_flag,
+				delta_flag ? VERIFICATOR_RESTORE_DELTA : 0, vfd);
+	}
 
-			int len = strlen(id_opt);
-			if (id_optp - id_opt == len + 1) {
-				int id;
-				sscanf(id_opt, "%i", &id);
-				verificator_make_query_by_id(db, id, vfd, get_diff_callback);
-			}
-		} else if (name_flag && name_opt) {
-			int len = strlen(name_opt);
-			if (len > 0 && len < 255) {
-				verificator_make_query_by_name(db, name_opt,
-								vfd, get_diff_callback);
-			}
-		} else {
-			fprintf(stderr, "Error! Cant verify code! Args is not correct\n");
-		}
+	if (scan_region) {
+		verificator_scan_region_by_spec(db, vfd, scan_region, update_region_flag);
 	}
 
-	if (restore_flag) {
-		if (id_flag && id_opt) {
-			char *id_optp = id_opt;
+	if (daemon_flag) {
+		verificator_daemon(db, flat_path, vfd, interval, load_flag);
+	}
 
-			while (isdigit(*id_optp++));
+	/* After the other actions, so their own cost shows up */
+	if (stats_flag) {
+		verificator_print_stats(VERIFICATOR_STATS);
+	}
 
-			int len = strlen(id_opt);
-			if (id_optp - id_opt == len + 1) {
-				int id;
-				sscanf(id_opt, "%i", &id);
-				verificator_make_query_by_id(db, id, vfd, restore_code_callback);
-			}
-		} else if (name_flag && name_opt) {
-			int len = strlen(name_opt);
-			if (len > 0 && len < 255) {
-				verificator_make_query_by_name(db, name_opt,
-								vfd, restore_code_callback);
-			}
-		} else {
-			fprintf(stderr, "Error! Cant verify code! Args is not correct\n");
-		}
+	if (watch_flag) {
+		verificator_watch(vfd);
 	}
 
 	sqlite3_free(err);
-	sqlite3_close(db);
+	baseline_close(db);
+	flat_baseline_close(&flat);
 
 	verificator_close(vfd);
 
@@ -1,11 +1,63 @@
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <wmmintrin.h>
 #include "crc16.h"
 
+/* CRC-16 (IBM/ARC) table, same as the kernel lib/crc16.c */
+unsigned short const crc16_table[256] = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+/*
+ * crc16_slice[k][i] is the CRC of byte i followed by k zero bytes,
+ * crc16_slice[0] is crc16_table.
+ */
+static unsigned short crc16_slice[8][256];
+
+/*
+ * Folding constants for the carry-less multiply path: x^(D+63) mod P in
+ * the low and x^(D-1) mod P in the high qword, bit-reflected.
+ */
+static uint64_t crc16_fold_k[4][2];
+
 static inline unsigned short crc16_byte(unsigned short crc, const unsigned char data)
 {
 	return (crc >> 8) ^ crc16_table[(crc ^ data) & 0xff];
 }
 
-unsigned short crc16(unsigned short crc, unsigned char const *buffer, size_t len)
+unsigned short crc16_bytewise(unsigned short crc, unsigned char const *buffer, size_t len)
 {
 	while (len--) {
 		crc = crc16_byte(crc, *buffer++);
@@ -13,3 +65,158 @@ unsigned short crc16(unsigned short crc, unsigned char const *buffer, size_t len
 
 	return crc;
 }
+
+/* Assumes a little-endian host, as everything else in usermode does */
+unsigned short crc16_slice8(unsigned short crc, unsigned char const *buffer, size_t len)
+{
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, buffer, sizeof(word));
+		word ^= crc;
+		crc = crc16_slice[7][word & 0xff] ^
+		      crc16_slice[6][(word >> 8) & 0xff] ^
+		      crc16_slice[5][(word >> 16) & 0xff] ^
+		      crc16_slice[4][(word >> 24) & 0xff] ^
+		      crc16_slice[3][(word >> 32) & 0xff] ^
+		      crc16_slice[2][(word >> 40) & 0xff] ^
+		      crc16_slice[1][(word >> 48) & 0xff] ^
+		      crc16_slice[0][word >> 56];
+		buffer += 8;
+		len -= 8;
+	}
+
+	return crc16_bytewise(crc, buffer, len);
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc16_fold(__m128i acc, int distance)
+{
+	__m128i k = _mm_set_epi64x(crc16_fold_k[distance][1], crc16_fold_k[distance][0]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00),
+			     _mm_clmulepi64_si128(acc, k, 0x11));
+}
+
+/*
+ * Folds the message 64 bytes at a time into a 128-bit value congruent to
+ * it modulo the CRC polynomial, then finishes that value and the tail
+ * with the table code. The incoming crc is simply xored into the first
+ * two message bytes.
+ */
+#define CRC16_FOLD_128 0
+#define CRC16_FOLD_256 1
+#define CRC16_FOLD_384 2
+#define CRC16_FOLD_512 3
+
+__attribute__((target("pclmul,sse2")))
+unsigned short crc16_clmul(unsigned short crc, unsigned char const *buffer, size_t len)
+{
+	unsigned char tail[16];
+	__m128i x0, x1, x2, x3;
+
+	if (len < 128) {
+		return crc16_slice8(crc, buffer, len);
+	}
+
+	x0 = _mm_loadu_si128((const __m128i *)buffer);
+	x1 = _mm_loadu_si128((const __m128i *)(buffer + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(buffer + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(buffer + 48));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+	buffer += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(crc16_fold(x0, CRC16_FOLD_512),
+				   _mm_loadu_si128((const __m128i *)buffer));
+		x1 = _mm_xor_si128(crc16_fold(x1, CRC16_FOLD_512),
+				   _mm_loadu_si128((const __m128i *)(buffer + 16)));
+		x2 = _mm_xor_si128(crc16_fold(x2, CRC16_FOLD_512),
+				   _mm_loadu_si128((const __m128i *)(buffer + 32)));
+		x3 = _mm_xor_si128(crc16_fold(x3, CRC16_FOLD_512),
+				   _mm_loadu_si128((const __m128i *)(buffer + 48)));
+		buffer += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(crc16_fold(x0, CRC16_FOLD_384), crc16_fold(x1, CRC16_FOLD_256));
+	x0 = _mm_xor_si128(x0, crc16_fold(x2, CRC16_FOLD_128));
+	x0 = _mm_xor_si128(x0, x3);
+
+	while (len >= 16) {
+		x0 = _mm_xor_si128(crc16_fold(x0, CRC16_FOLD_128),
+				   _mm_loadu_si128((const __m128i *)buffer));
+		buffer += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)tail, x0);
+	crc = crc16_slice8(0, tail, sizeof(tail));
+
+	return crc16_slice8(crc, buffer, len);
+}
+
+/* x^n mod P(x) for P = x^16 + x^15 + x^2 + 1, bit-reflected into a qword */
+static uint64_t crc16_xpow_reflected(unsigned int n)
+{
+	uint32_t rem = 1;
+	uint64_t reflected = 0;
+	unsigned int d;
+
+	while (n--) {
+		rem <<= 1;
+		if (rem & 0x10000) {
+			rem ^= 0x18005;
+		}
+	}
+
+	for (d = 0; d < 16; d++) {
+		if (rem & (1U << d)) {
+			reflected |= 1ULL << (63 - d);
+		}
+	}
+
+	return reflected;
+}
+
+static unsigned short (*crc16_impl)(unsigned short, unsigned char const *, size_t) = crc16_slice8;
+
+__attribute__((constructor))
+static void crc16_init(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc16_slice[0][i] = crc16_table[i];
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			unsigned short prev = crc16_slice[k - 1][i];
+
+			crc16_slice[k][i] = (prev >> 8) ^ crc16_table[prev & 0xff];
+		}
+	}
+
+	for (k = 0; k < 4; k++) {
+		unsigned int distance = 128 * (k + 1);
+
+		crc16_fold_k[k][0] = crc16_xpow_reflected(distance + 63);
+		crc16_fold_k[k][1] = crc16_xpow_reflected(distance - 1);
+	}
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL)) {
+		crc16_impl = crc16_clmul;
+	}
+}
+
+const char *crc16_impl_name(void)
+{
+	return crc16_impl == crc16_clmul ? "pclmul" : "slice8";
+}
+
+unsigned short crc16(unsigned short crc, unsigned char const *buffer, size_t len)
+{
+	return crc16_impl(crc, buffer, len);
+}
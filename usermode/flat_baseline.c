@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <verificator.h>
+#include "hash.h"
+#include "flat_baseline.h"
+
+/* FNV-1a */
+uint32_t flat_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static inline bool flat_in_file(size_t size, uint64_t offset, uint64_t len)
+{
+	return offset <= size && len <= size - offset;
+}
+
+int flat_baseline_attach(const void *map, size_t size, struct flat_baseline *fb)
+{
+	const struct flat_header *hdr = map;
+
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, FLAT_BASELINE_MAGIC, sizeof(hdr->magic)) != 0) {
+		return -1;
+	}
+
+	if (hdr->version != FLAT_BASELINE_VERSION || hdr->file_size != size ||
+			hdr->index_size == 0 || (hdr->index_size & (hdr->index_size - 1)) ||
+			hdr->index_size <= hdr->record_count ||
+			!flat_in_file(size, hdr->records_offset,
+				(uint64_t)hdr->record_count * sizeof(struct flat_record)) ||
+			!flat_in_file(size, hdr->index_offset,
+				(uint64_t)hdr->index_size * sizeof(uint32_t)) ||
+			hdr->records_offset % sizeof(uint64_t) || hdr->index_offset % sizeof(uint32_t) ||
+			hdr->blob_offset % sizeof(uint32_t) ||
+			hdr->names_offset > hdr->blob_offset || hdr->blob_offset > size) {
+		fprintf(stderr, "Flat baseline is corrupted\n");
+		return -1;
+	}
+
+	fb->map = map;
+	fb->size = size;
+	fb->hdr = hdr;
+	fb->records = (const struct flat_record *)((const char *)map + hdr->records_offset);
+	fb->index = (const uint32_t *)((const char *)map + hdr->index_offset);
+	fb->names = (const char *)map + hdr->names_offset;
+	fb->blob = (const unsigned char *)map + hdr->blob_offset;
+
+	return 0;
+}
+
+/*
+ * Records are checked when they are touched rather than at open, so that
+ * opening costs the same few page faults whatever the baseline size.
+ */
+static bool flat_record_valid(const struct flat_baseline *fb, const struct flat_record *rec)
+{
+	uint64_t names_size = fb->hdr->blob_offset - fb->hdr->names_offset;
+	uint64_t blob_size = fb->size - fb->hdr->blob_offset;
+
+	if (rec->name_offset >= names_size ||
+			memchr(fb->names + rec->name_offset, '\0',
+				names_size - rec->name_offset) == NULL ||
+			!flat_in_file(blob_size, rec->code_offset, rec->size) ||
+			rec->blocks_offset % sizeof(uint32_t) ||
+			!flat_in_file(blob_size, rec->blocks_offset,
+				(uint64_t)rec->block_count * sizeof(uint32_t))) {
+		fprintf(stderr, "Flat baseline record %zu is corrupted\n",
+				(size_t)(rec - fb->records));
+		return false;
+	}
+
+	return true;
+}
+
+int flat_baseline_open(const char *path, struct flat_baseline *fb)
+{
+	struct stat 	st;
+	void 		*map;
+	int 		fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	if (flat_baseline_attach(map, st.st_size, fb) != 0) {
+		fprintf(stderr, "%s is not a flat baseline\n", path);
+		munmap(map, st.st_size ? st.st_size : 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+void flat_baseline_close(struct flat_baseline *fb)
+{
+	if (fb->map) {
+		munmap((void *)fb->map, fb->size);
+	}
+	memset(fb, 0, sizeof(*fb));
+}
+
+const struct flat_record *flat_baseline_find_name(const struct flat_baseline *fb, const char *name)
+{
+	uint32_t hash = flat_name_hash(name);
+	uint32_t mask = fb->hdr->index_size - 1;
+	uint32_t slot;
+
+	for (slot = hash & mask; fb->index[slot]; slot = (slot + 1) & mask) {
+		uint32_t n = fb->index[slot] - 1;
+		const struct flat_record *rec;
+
+		if (n >= fb->hdr->record_count) {
+			break;
+		}
+		rec = &fb->records[n];
+		if (rec->name_hash == hash && flat_record_valid(fb, rec) &&
+				strcmp(fb->names + rec->name_offset, name) == 0) {
+			return rec;
+		}
+	}
+
+	return NULL;
+}
+
+/* First record with an address not below addr */
+static uint32_t flat_lower_bound(const struct flat_baseline *fb, unsigned long addr)
+{
+	uint32_t lo = 0, hi = fb->hdr->record_count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (fb->records[mid].addr < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+const struct flat_record *flat_baseline_find_addr(const struct flat_baseline *fb, unsigned long addr)
+{
+	uint32_t n = flat_lower_bound(fb, addr);
+	const struct flat_record *rec;
+
+	if (n < fb->hdr->record_count && fb->records[n].addr == addr) {
+		rec = &fb->records[n];
+	} else if (n > 0 && addr - fb->records[n - 1].addr < fb->records[n - 1].size) {
+		rec = &fb->records[n - 1];
+	} else {
+		return NULL;
+	}
+
+	return flat_record_valid(fb, rec) ? rec : NULL;
+}
+
+void flat_baseline_entry(const struct flat_baseline *fb, const struct flat_record *rec,
+			struct verification_entry *entry)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->id = rec->id;
+	entry->name = fb->names + rec->name_offset;
+	entry->addr = rec->addr;
+	entry->size = rec->size;
+	entry->code = fb->blob + rec->code_offset;
+	entry->hash = rec->hash;
+	entry->hash_algo = rec->hash_algo;
+	entry->has_hash = true;
+	entry->block_hashes = fb->blob + rec->blocks_offset;
+	entry->block_count = rec->block_count;
+	entry->merkle_root = rec->merkle_root;
+}
+
+static int flat_run(const struct flat_baseline *fb, const struct flat_record *rec,
+			void *ctx, verification_entry_cb callback)
+{
+	struct verification_entry entry;
+
+	if (!flat_record_valid(fb, rec)) {
+		return -1;
+	}
+
+	flat_baseline_entry(fb, rec, &entry);
+	return callback(ctx, &entry);
+}
+
+int flat_baseline_query_all(const struct flat_baseline *fb, void *ctx, verification_entry_cb callback)
+{
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < fb->hdr->record_count && ret == 0; i++) {
+		ret = flat_run(fb, &fb->records[i], ctx, callback);
+	}
+
+	return ret;
+}
+
+int flat_baseline_query_by_id(const struct flat_baseline *fb, int id, void *ctx,
+				verification_entry_cb callback)
+{
+	uint32_t i;
+
+	for (i = 0; i < fb->hdr->record_count; i++) {
+		if (fb->records[i].id == (uint32_t)id) {
+			return flat_run(fb, &fb->records[i], ctx, callback);
+		}
+	}
+
+	return 0;
+}
+
+int flat_baseline_query_by_name(const struct flat_baseline *fb, const char *name, void *ctx,
+				verification_entry_cb callback)
+{
+	const struct flat_record *rec = flat_baseline_find_name(fb, name);
+
+	return rec ? flat_run(fb, rec, ctx, callback) : 0;
+}
+
+int flat_baseline_query_by_name_prefix(const struct flat_baseline *fb, const char *prefix,
+				void *ctx, verification_entry_cb callback)
+{
+	size_t 		len = strlen(prefix);
+	uint32_t 	i;
+	int 		ret = 0;
+
+	for (i = 0; i < fb->hdr->record_count && ret == 0; i++) {
+		if (!flat_record_valid(fb, &fb->records[i])) {
+			return -1;
+		}
+		if (strncmp(fb->names + fb->records[i].name_offset, prefix, len) == 0) {
+			ret = flat_run(fb, &fb->records[i], ctx, callback);
+		}
+	}
+
+	return ret;
+}
+
+int flat_baseline_query_by_addr_range(const struct flat_baseline *fb, unsigned long start,
+				unsigned long end, void *ctx, verification_entry_cb callback)
+{
+	uint32_t 	i;
+	int 		ret = 0;
+
+	for (i = flat_lower_bound(fb, start);
+			i < fb->hdr->record_count && fb->records[i].addr <= end && ret == 0; i++) {
+		ret = flat_run(fb, &fb->records[i], ctx, callback);
+	}
+
+	return ret;
+}
+
+/* Rows of the table copied out of their statements for export */
+struct flat_row {
+	char 			*name;
+	unsigned char 		*code;
+	unsigned int 		*blocks;
+	struct flat_record 	rec;
+};
+
+struct flat_rows {
+	struct flat_row 	*rows;
+	size_t 			count;
+	size_t 			capacity;
+	uint64_t 		names_size;
+	uint64_t 		blob_size;
+};
+
+static int flat_export_row(void *ctx, struct verification_entry *entry)
+{
+	struct flat_rows 	*rows = ctx;
+	struct flat_row 	*row;
+	const char 		*name = entry->name ? entry->name : "";
+
+	if (rows->count == rows->capacity) {
+		size_t capacity = rows->capacity ? rows->capacity * 2 : 1024;
+		void *p = realloc(rows->rows, capacity * sizeof(*rows->rows));
+
+		if (p == NULL) {
+			fprintf(stderr, "Cannot alloc memory for export\n");
+			return -1;
+		}
+		rows->rows = p;
+		rows->capacity = capacity;
+	}
+
+	row = &rows->rows[rows->count];
+	memset(row, 0, sizeof(*row));
+	row->rec.addr = entry->addr;
+	row->rec.size = entry->size;
+	row->rec.hash_algo = entry->hash_algo;
+	row->rec.hash = baseline_entry_hash(entry, entry->hash_algo);
+	row->rec.name_hash = flat_name_hash(name);
+	row->rec.id = entry->id;
+	row->rec.block_count = (entry->size + VERIFICATOR_BLOCK_SIZE - 1) / VERIFICATOR_BLOCK_SIZE;
+
+	row->name = strdup(name);
+	row->code = malloc(entry->size);
+	row->blocks = malloc(row->rec.block_count * sizeof(*row->blocks) + 1);
+	if (row->name == NULL || row->code == NULL || row->blocks == NULL) {
+		fprintf(stderr, "Cannot alloc memory for export\n");
+		free(row->name);
+		free(row->code);
+		free(row->blocks);
+		return -1;
+	}
+	memcpy(row->code, entry->code, entry->size);
+
+	if (entry->block_hashes && entry->block_count == row->rec.block_count) {
+		memcpy(row->blocks, entry->block_hashes, row->rec.block_count * sizeof(*row->blocks));
+		row->rec.merkle_root = entry->merkle_root;
+	} else {
+		row->rec.merkle_root = block_hashes(entry->code, entry->size,
+					VERIFICATOR_BLOCK_SIZE, row->blocks);
+	}
+
+	rows->count++;
+	return 0;
+}
+
+static int flat_row_cmp(const void *a, const void *b)
+{
+	const struct flat_row *l = a, *r = b;
+
+	return l->rec.addr < r->rec.addr ? -1 : l->rec.addr > r->rec.addr;
+}
+
+static const unsigned char flat_pad[8];
+
+int flat_baseline_export(sqlite3 *db, const char *path)
+{
+	struct flat_header 	hdr = {0};
+	struct flat_rows 	rows = {0};
+	uint32_t 		*index = NULL;
+	char 			*tmp = NULL;
+	FILE 			*out = NULL;
+	size_t 			i;
+	int 			ret = -1;
+
+	if (baseline_query_all(db, &rows, flat_export_row) != 0) {
+		goto out;
+	}
+
+	qsort(rows.rows, rows.count, sizeof(*rows.rows), flat_row_cmp);
+
+	for (i = 0; i < rows.count; i++) {
+		struct flat_row *row = &rows.rows[i];
+
+		row->rec.name_offset = rows.names_size;
+		rows.names_size += strlen(row->name) + 1;
+		row->rec.code_offset = rows.blob_size;
+		rows.blob_size += (row->rec.size + 3) & ~3U;
+		row->rec.blocks_offset = rows.blob_size;
+		rows.blob_size += row->rec.block_count * sizeof(*row->blocks);
+	}
+
+	memcpy(hdr.magic, FLAT_BASELINE_MAGIC, sizeof(hdr.magic));
+	hdr.version = FLAT_BASELINE_VERSION;
+	hdr.record_count = rows.count;
+	hdr.index_size = 16;
+	while (hdr.index_size < 2 * rows.count) {
+		hdr.index_size <<= 1;
+	}
+	hdr.records_offset = sizeof(hdr);
+	hdr.index_offset = hdr.records_offset + rows.count * sizeof(struct flat_record);
+	hdr.names_offset = hdr.index_offset + hdr.index_size * sizeof(uint32_t);
+	hdr.blob_offset = (hdr.names_offset + rows.names_size + 7) & ~7ULL;
+	hdr.file_size = hdr.blob_offset + rows.blob_size;
+
+	index = calloc(hdr.index_size, sizeof(*index));
+	if (index == NULL) {
+		fprintf(stderr, "Cannot alloc memory for export\n");
+		goto out;
+	}
+	for (i = 0; i < rows.count; i++) {
+		uint32_t slot = rows.rows[i].rec.name_hash & (hdr.index_size - 1);
+
+		while (index[slot]) {
+			slot = (slot + 1) & (hdr.index_size - 1);
+		}
+		index[slot] = i + 1;
+	}
+
+	/* Written next to the target and renamed, readers never see half a file */
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+	out = fopen(tmp, "wb");
+	if (out == NULL) {
+		perror(tmp);
+		goto out;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	for (i = 0; i < rows.count; i++) {
+		fwrite(&rows.rows[i].rec, sizeof(rows.rows[i].rec), 1, out);
+	}
+	fwrite(index, sizeof(*index), hdr.index_size, out);
+	for (i = 0; i < rows.count; i++) {
+		fwrite(rows.rows[i].name, strlen(rows.rows[i].name) + 1, 1, out);
+	}
+	fwrite(flat_pad, hdr.blob_offset - hdr.names_offset - rows.names_size, 1, out);
+	for (i = 0; i < rows.count; i++) {
+		struct flat_row *row = &rows.rows[i];
+
+		fwrite(row->code, row->rec.size, 1, out);
+		fwrite(flat_pad, ((row->rec.size + 3) & ~3U) - row->rec.size, 1, out);
+		fwrite(row->blocks, sizeof(*row->blocks), row->rec.block_count, out);
+	}
+
+	if (ferror(out) | fclose(out)) {
+		fprintf(stderr, "Cannot write %s\n", tmp);
+		out = NULL;
+		unlink(tmp);
+		goto out;
+	}
+	out = NULL;
+
+	if (rename(tmp, path) != 0) {
+		perror(path);
+		unlink(tmp);
+		goto out;
+	}
+
+	printf("Exported %zu functions to %s\n", rows.count, path);
+	ret = 0;
+
+out:
+	if (out) {
+		fclose(out);
+		unlink(tmp);
+	}
+	for (i = 0; i < rows.count; i++) {
+		free(rows.rows[i].name);
+		free(rows.rows[i].code);
+		free(rows.rows[i].blocks);
+	}
+	free(rows.rows);
+	free(index);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,94 @@
+#ifndef VERIFICATOR_FLAT_BASELINE_H
+#define VERIFICATOR_FLAT_BASELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+#include "baseline_db.h"
+
+/*
+ * Flat baseline: a read-only image of the verificator table meant to be
+ * mmap()ed and used in place. Layout, all offsets from the file start:
+ *
+ *   struct flat_header
+ *   struct flat_record[record_count]  sorted by address
+ *   uint32_t index[index_size]        open addressing name index
+ *   names                             NUL-terminated
+ *   blob                              code, then 4-aligned block digests
+ *
+ * index slots hold a record number + 1 (0 is empty) at
+ * flat_name_hash(name) & (index_size - 1), probing linearly.
+ */
+#define FLAT_BASELINE_MAGIC 	"VRFFLAT1"
+#define FLAT_BASELINE_VERSION 	1
+
+struct flat_header {
+	char 		magic[8];
+	uint32_t 	version;
+	uint32_t 	record_count;
+	uint32_t 	index_size; 	/* power of 2 */
+	uint32_t 	reserved;
+	uint64_t 	records_offset;
+	uint64_t 	index_offset;
+	uint64_t 	names_offset;
+	uint64_t 	blob_offset;
+	uint64_t 	file_size;
+};
+
+struct flat_record {
+	uint64_t 	addr;
+	uint64_t 	hash;
+	uint64_t 	code_offset; 	/* from blob_offset */
+	uint64_t 	blocks_offset; 	/* from blob_offset */
+	uint32_t 	size;
+	uint32_t 	hash_algo;
+	uint32_t 	name_offset; 	/* from names_offset */
+	uint32_t 	name_hash;
+	uint32_t 	block_count;
+	uint32_t 	merkle_root;
+	uint32_t 	id;
+	uint32_t 	reserved;
+};
+
+struct flat_baseline {
+	const unsigned char 		*map;
+	size_t 				size;
+	const struct flat_header 	*hdr;
+	const struct flat_record 	*records;
+	const uint32_t 			*index;
+	const char 			*names;
+	const unsigned char 		*blob;
+};
+
+uint32_t flat_name_hash(const char *name);
+
+/*
+ * Maps path read-only and checks the header and table bounds. Records are
+ * checked to stay inside the mapping only when a lookup touches them.
+ */
+int flat_baseline_open(const char *path, struct flat_baseline *fb);
+int flat_baseline_attach(const void *map, size_t size, struct flat_baseline *fb);
+void flat_baseline_close(struct flat_baseline *fb);
+
+const struct flat_record *flat_baseline_find_name(const struct flat_baseline *fb, const char *name);
+/* Record whose code covers addr */
+const struct flat_record *flat_baseline_find_addr(const struct flat_baseline *fb, unsigned long addr);
+
+/* Entries point into the mapping and stay valid until flat_baseline_close() */
+void flat_baseline_entry(const struct flat_baseline *fb, const struct flat_record *rec,
+			struct verification_entry *entry);
+
+int flat_baseline_query_all(const struct flat_baseline *fb, void *ctx, verification_entry_cb callback);
+int flat_baseline_query_by_id(const struct flat_baseline *fb, int id, void *ctx,
+				verification_entry_cb callback);
+int flat_baseline_query_by_name(const struct flat_baseline *fb, const char *name, void *ctx,
+				verification_entry_cb callback);
+int flat_baseline_query_by_name_prefix(const struct flat_baseline *fb, const char *prefix,
+				void *ctx, verification_entry_cb callback);
+int flat_baseline_query_by_addr_range(const struct flat_baseline *fb, unsigned long start,
+				unsigned long end, void *ctx, verification_entry_cb callback);
+
+/* Writes every row of the verificator table to path */
+int flat_baseline_export(sqlite3 *db, const char *path);
+
+#endif
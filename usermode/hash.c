@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <verificator.h>
+#include "crc16.h"
+#include "hash.h"
+
+#define CRC32C_POLY 0x82F63B78
+
+static unsigned int crc32c_table[256];
+
+static unsigned int crc32c_sw(unsigned int crc, unsigned char const *buffer, size_t len)
+{
+	while (len--) {
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *buffer++) & 0xff];
+	}
+
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, unsigned char const *buffer, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	while (len && ((uintptr_t)buffer & 7)) {
+		crc64 = _mm_crc32_u8((unsigned int)crc64, *buffer++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, buffer, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		buffer += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc64 = _mm_crc32_u8((unsigned int)crc64, *buffer++);
+	}
+
+	return (unsigned int)crc64;
+}
+
+static unsigned int (*crc32c_impl)(unsigned int, unsigned char const *, size_t);
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		unsigned int crc = i;
+
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc32c_table[i] = crc;
+	}
+
+	crc32c_impl = crc32c_sw;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+		crc32c_impl = crc32c_hw;
+	}
+}
+
+unsigned int crc32c(unsigned int crc, unsigned char const *buffer, size_t len)
+{
+	return crc32c_impl(crc, buffer, len);
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+unsigned long long xxh64(const void *buffer, size_t len, unsigned long long seed)
+{
+	const unsigned char *p = buffer;
+	const unsigned char *end = p + len;
+	uint64_t h64;
+
+	if (len >= 32) {
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = xxh64_round(v1, xxh_read64(p));
+			v2 = xxh64_round(v2, xxh_read64(p + 8));
+			v3 = xxh64_round(v3, xxh_read64(p + 16));
+			v4 = xxh64_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h64 = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) +
+		      xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+		h64 = xxh64_merge_round(h64, v1);
+		h64 = xxh64_merge_round(h64, v2);
+		h64 = xxh64_merge_round(h64, v3);
+		h64 = xxh64_merge_round(h64, v4);
+	} else {
+		h64 = seed + XXH_PRIME64_5;
+	}
+
+	h64 += len;
+
+	while (p + 8 <= end) {
+		h64 ^= xxh64_round(0, xxh_read64(p));
+		h64 = xxh_rotl64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h64 ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+		h64 = xxh_rotl64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h64 ^= (*p) * XXH_PRIME64_5;
+		h64 = xxh_rotl64(h64, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	h64 ^= h64 >> 33;
+	h64 *= XXH_PRIME64_2;
+	h64 ^= h64 >> 29;
+	h64 *= XXH_PRIME64_3;
+	h64 ^= h64 >> 32;
+
+	return h64;
+}
+
+unsigned long long verificator_hash(unsigned int algo, unsigned char const *buffer, size_t len)
+{
+	switch (algo) {
+		case VERIFICATOR_HASH_CRC32C:
+			return ~crc32c(~0U, buffer, len);
+		case VERIFICATOR_HASH_XXH64:
+			return xxh64(buffer, len, 0);
+		default:
+			return crc16(0, buffer, len);
+	}
+}
+
+static inline unsigned int block_crc32c(const void *data, size_t len)
+{
+	return ~crc32c(~0U, data, len);
+}
+
+/* Assumes a little-endian host, the kernel stores the pair as __le32 */
+static inline unsigned int merkle_node(unsigned int left, unsigned int right)
+{
+	unsigned int pair[2] = { left, right };
+
+	return block_crc32c(pair, sizeof(pair));
+}
+
+struct merkle_stack {
+	unsigned int 	hash[64];
+	unsigned char 	height[64];
+	unsigned int 	depth;
+};
+
+static void merkle_push(struct merkle_stack *ms, unsigned int hash)
+{
+	unsigned char height = 0;
+
+	while (ms->depth && ms->height[ms->depth - 1] == height) {
+		hash = merkle_node(ms->hash[--ms->depth], hash);
+		height++;
+	}
+
+	ms->hash[ms->depth] = hash;
+	ms->height[ms->depth++] = height;
+}
+
+static unsigned int merkle_fold(struct merkle_stack *ms)
+{
+	unsigned int hash;
+
+	if (ms->depth == 0) {
+		return 0;
+	}
+
+	hash = ms->hash[--ms->depth];
+	while (ms->depth) {
+		hash = merkle_node(ms->hash[--ms->depth], hash);
+	}
+
+	return hash;
+}
+
+unsigned int merkle_root(const unsigned int *hashes, unsigned int count)
+{
+	struct merkle_stack ms = { .depth = 0 };
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		merkle_push(&ms, hashes[i]);
+	}
+
+	return merkle_fold(&ms);
+}
+
+unsigned int block_hashes(unsigned char const *buffer, size_t len,
+			unsigned int block_size, unsigned int *hashes)
+{
+	struct merkle_stack ms = { .depth = 0 };
+
+	while (len) {
+		size_t chunk = len < block_size ? len : block_size;
+
+		*hashes = block_crc32c(buffer, chunk);
+		merkle_push(&ms, *hashes++);
+		buffer += chunk;
+		len -= chunk;
+	}
+
+	return merkle_fold(&ms);
+}
+
+static const char *hash_algo_names[VERIFICATOR_HASH_MAX] = {
+	[VERIFICATOR_HASH_CRC16] 	= "crc16",
+	[VERIFICATOR_HASH_CRC32C] 	= "crc32c",
+	[VERIFICATOR_HASH_XXH64] 	= "xxh64",
+};
+
+int hash_algo_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < VERIFICATOR_HASH_MAX; i++) {
+		if (strcmp(name, hash_algo_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+const char *hash_algo_name(unsigned int algo)
+{
+	return algo < VERIFICATOR_HASH_MAX ? hash_algo_names[algo] : "unknown";
+}
@@ -0,0 +1,55 @@
+#ifndef VERIFICATOR_HASH_H
+#define VERIFICATOR_HASH_H
+
+#include <stddef.h>
+
+/**
+ * crc32c - update a raw CRC-32C (Castagnoli) value
+ * @crc:	previous CRC value, ~0 for a new digest
+ * @buffer:	data pointer
+ * @len:	number of bytes in the buffer
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it. Like the kernel
+ * crc32c() the value is neither pre- nor post-inverted.
+ */
+unsigned int crc32c(unsigned int crc, unsigned char const *buffer, size_t len);
+
+/**
+ * xxh64 - compute the XXH64 digest of the data buffer
+ * @buffer:	data pointer
+ * @len:	number of bytes in the buffer
+ * @seed:	hash seed
+ */
+unsigned long long xxh64(const void *buffer, size_t len, unsigned long long seed);
+
+/**
+ * verificator_hash - compute a digest the same way the kernel module does
+ * @algo:	enum verificator_hash_algo
+ * @buffer:	data pointer
+ * @len:	number of bytes in the buffer
+ */
+unsigned long long verificator_hash(unsigned int algo, unsigned char const *buffer, size_t len);
+
+/**
+ * block_hashes - per-block CRC32C digests as VERIFICATOR_GET_BLOCK_HASHES
+ * @buffer:	data pointer
+ * @len:	number of bytes in the buffer
+ * @block_size:	bytes per block, the last block may be short
+ * @hashes:	DIV_ROUND_UP(len, block_size) digests are stored here
+ *
+ * Returns the Merkle root of the blocks.
+ */
+unsigned int block_hashes(unsigned char const *buffer, size_t len,
+			unsigned int block_size, unsigned int *hashes);
+
+/**
+ * merkle_root - Merkle root over block digests, same tree as the kernel
+ * @hashes:	block digests
+ * @count:	number of digests
+ */
+unsigned int merkle_root(const unsigned int *hashes, unsigned int count);
+
+int hash_algo_by_name(const char *name);
+const char *hash_algo_name(unsigned int algo);
+
+#endif
@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <verificator.h>
+#include "hash.h"
+#include "verificator_backend.h"
+
+/* Image of kernel text served by the file backend, NULL for the kernel */
+struct text_image {
+	char 			*path;
+	unsigned char 		*map;
+	size_t 			size;
+	unsigned long 		base;
+	pthread_mutex_t 	restore_lock;
+	unsigned int 		baseline_count;
+};
+
+static struct text_image *image;
+
+int verificator_image_spec(const char *spec, char **path, unsigned long *base)
+{
+	const char *at = strrchr(spec, '@');
+	char *end;
+
+	*base = VERIFICATOR_IMAGE_BASE;
+	if (at == NULL) {
+		*path = strdup(spec);
+		return *path ? 0 : -1;
+	}
+
+	*base = strtoul(at + 1, &end, 0);
+	if (at == spec || *end != '\0') {
+		fprintf(stderr, "Bad image spec %s, expected PATH[@BASE]\n", spec);
+		return -1;
+	}
+
+	*path = strndup(spec, at - spec);
+	return *path ? 0 : -1;
+}
+
+static int text_image_map(const char *spec)
+{
+	struct text_image 	*img;
+	struct stat 		st;
+	int 			fd;
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		return -1;
+	}
+
+	if (verificator_image_spec(spec, &img->path, &img->base) != 0) {
+		free(img);
+		return -1;
+	}
+
+	fd = open(img->path, O_RDWR);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "Cannot open text image %s\n", img->path);
+		goto err;
+	}
+
+	img->size = st.st_size;
+	img->map = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (img->map == MAP_FAILED) {
+		perror("Cannot map text image");
+		goto err;
+	}
+	close(fd);
+
+	pthread_mutex_init(&img->restore_lock, NULL);
+	image = img;
+	return 0;
+
+err:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(img->path);
+	free(img);
+	return -1;
+}
+
+int verificator_backend_set(const char *spec)
+{
+	if (spec == NULL || strcmp(spec, "kernel") == 0) {
+		return 0;
+	}
+
+	if (strncmp(spec, "file:", 5) == 0) {
+		return text_image_map(spec + 5);
+	}
+
+	fprintf(stderr, "Unknown backend %s, expected kernel or file:PATH[@BASE]\n", spec);
+	return -1;
+}
+
+int verificator_backend_is_kernel(void)
+{
+	return image == NULL;
+}
+
+/* Addresses of two symbols, 0 for those kallsyms hides or lacks */
+static void kallsyms_bounds(const char *first, const char *last,
+				unsigned long *start, unsigned long *end)
+{
+	unsigned long 	addr;
+	char 		type;
+	char 		sym[256];
+	FILE 		*f;
+
+	*start = *end = 0;
+
+	f = fopen("/proc/kallsyms", "r");
+	if (f == NULL) {
+		return;
+	}
+
+	while (fscanf(f, "%lx %c %255s%*[^\n]", &addr, &type, sym) == 3) {
+		if (strcmp(sym, first) == 0) {
+			*start = addr;
+		} else if (strcmp(sym, last) == 0) {
+			*end = addr;
+		}
+		if (*start && *end) {
+			break;
+		}
+	}
+	fclose(f);
+}
+
+int verificator_backend_section(const char *name, long *addr, size_t *size)
+{
+	static const char * const sections[][3] = {
+		{ "text", 	"_stext", 		"_etext" },
+		{ "rodata", 	"__start_rodata", 	"__end_rodata" },
+	};
+	unsigned long 	start, end;
+	size_t 		i;
+
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		if (strcmp(name, sections[i][0]) == 0) {
+			break;
+		}
+	}
+	if (i == sizeof(sections) / sizeof(sections[0])) {
+		fprintf(stderr, "Unknown section %s\n", name);
+		return -1;
+	}
+
+	/* The image stands in for the text section, nothing else is there */
+	if (image) {
+		if (i != 0) {
+			fprintf(stderr, "The file backend only has a text section\n");
+			return -1;
+		}
+		*addr = image->base;
+		*size = image->size;
+		return 0;
+	}
+
+	kallsyms_bounds(sections[i][1], sections[i][2], &start, &end);
+	if (start == 0 || end <= start) {
+		fprintf(stderr, "Cannot get %s bounds from /proc/kallsyms\n", name);
+		return -1;
+	}
+
+	*addr = start;
+	*size = end - start;
+	return 0;
+}
+
+int verificator_backend_open(const char *device)
+{
+	if (image == NULL) {
+		return open(device, O_RDWR);
+	}
+
+	/* Any real descriptor will do, it only has to be closed later */
+	return open(image->path, O_RDONLY);
+}
+
+void verificator_backend_close(int vfd)
+{
+	close(vfd);
+}
+
+/*
+ * The ioctls below follow kernel/verificator.c: same argument checks,
+ * same results, a negative errno on failure. Addresses are valid when
+ * the whole range lies inside the image.
+ */
+static unsigned char *image_text(long addr, size_t size)
+{
+	unsigned long offset = (unsigned long)addr - image->base;
+
+	if (size == 0 || (unsigned long)addr < image->base ||
+			offset >= image->size || size > image->size - offset) {
+		return NULL;
+	}
+
+	return image->map + offset;
+}
+
+static long image_verify_code(struct verificator_verify_struct *args)
+{
+	const unsigned char *text = image_text(args->vrf_addr, args->vrf_size);
+
+	if (text == NULL || args->hash_algo >= VERIFICATOR_HASH_MAX) {
+		return -EINVAL;
+	}
+
+	args->vrf_actual = verificator_hash(args->hash_algo, text, args->vrf_size);
+
+	return args->vrf_actual != args->hash ? VERIFICATOR_MISMATCH : 0;
+}
+
+static long image_verify_batch(struct verificator_verify_batch_struct *args)
+{
+	long mismatches = 0;
+	unsigned int i;
+
+	if (args->vrb_count == 0 || args->vrb_count > VERIFICATOR_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < args->vrb_count; i++) {
+		struct verificator_verify_entry *entry = &args->vrb_entries[i];
+		struct verificator_verify_struct vargs = {
+			.vrf_addr = entry->vrf_addr,
+			.vrf_size = entry->vrf_size,
+			.hash = entry->hash,
+			.hash_algo = entry->hash_algo,
+		};
+
+		entry->vrf_result = image_verify_code(&vargs);
+		entry->vrf_actual = vargs.vrf_actual;
+		if (entry->vrf_result == VERIFICATOR_MISMATCH) {
+			mismatches++;
+		}
+	}
+
+	return mismatches;
+}
+
+static long image_get_diff(struct verificator_get_diff_struct *args)
+{
+	const unsigned char *text = image_text(args->vrf_addr, args->vrf_size);
+
+	if (text == NULL) {
+		return -EINVAL;
+	}
+
+	memcpy(args->vrd_code, text, args->vrf_size);
+	return args->vrf_size;
+}
+
+static size_t image_restore_delta(unsigned char *live, const unsigned char *code, size_t size)
+{
+	size_t patched = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (live[i] != code[i]) {
+			live[i] = code[i];
+			patched++;
+		}
+	}
+
+	return patched;
+}
+
+static long image_restore(struct verificator_restore_struct *args)
+{
+	unsigned char *text = image_text(args->vrf_addr, args->vrf_size);
+	long ret = 0;
+
+	if (text == NULL) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&image->restore_lock);
+	if (args->vrr_flags & VERIFICATOR_RESTORE_DELTA) {
+		ret = image_restore_delta(text, args->vrr_code, args->vrf_size);
+	} else {
+		memcpy(text, args->vrr_code, args->vrf_size);
+	}
+	pthread_mutex_unlock(&image->restore_lock);
+
+	return ret;
+}
+
+static long image_restore_batch(struct verificator_restore_batch_struct *args)
+{
+	long restored = 0;
+	unsigned int i;
+
+	if (args->vrrb_count == 0 || args->vrrb_count > VERIFICATOR_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&image->restore_lock);
+	for (i = 0; i < args->vrrb_count; i++) {
+		struct verificator_restore_entry *entry = &args->vrrb_entries[i];
+		unsigned char *text = image_text(entry->vrf_addr, entry->vrf_size);
+
+		if (text == NULL) {
+			entry->vrr_result = -EINVAL;
+			continue;
+		}
+
+		entry->vrr_result = 0;
+		if (args->vrrb_flags & VERIFICATOR_RESTORE_DELTA) {
+			entry->vrr_result = image_restore_delta(text, entry->vrr_code,
+								entry->vrf_size);
+		} else {
+			memcpy(text, entry->vrr_code, entry->vrf_size);
+		}
+		restored++;
+	}
+	pthread_mutex_unlock(&image->restore_lock);
+
+	return restored;
+}
+
+static long image_block_hashes(struct verificator_block_hashes_struct *args)
+{
+	const unsigned char 	*text = image_text(args->vrf_addr, args->vrf_size);
+	unsigned int 		block_size;
+	unsigned int 		count;
+
+	if (text == NULL) {
+		return -EINVAL;
+	}
+
+	block_size = args->vbh_block_size ? args->vbh_block_size : VERIFICATOR_BLOCK_SIZE;
+	if ((block_size & (block_size - 1)) || block_size < 16 ||
+			block_size > sysconf(_SC_PAGESIZE)) {
+		return -EINVAL;
+	}
+
+	count = (args->vrf_size + block_size - 1) / block_size;
+	if (args->vbh_count < count) {
+		args->vbh_count = count;
+		return -ENOSPC;
+	}
+
+	args->vbh_block_size = block_size;
+	args->vbh_count = count;
+	args->vbh_root = block_hashes(text, args->vrf_size, block_size, args->vbh_hashes);
+
+	return count;
+}
+
+static long image_diff(struct verificator_diff_struct *args)
+{
+	const unsigned char 	*live = image_text(args->vrf_addr, args->vrf_size);
+	const unsigned char 	*expected = args->vrd_expected;
+	size_t 			capacity = args->vrd_runs_size;
+	size_t 			used = 0;
+	size_t 			differ = 0;
+	unsigned int 		count = 0;
+	long 			run_start = -1;
+	size_t 			run_end = 0;
+	size_t 			i;
+
+	if (live == NULL || args->vrf_size > UINT_MAX) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i <= args->vrf_size; i++) {
+		if (i < args->vrf_size) {
+			if (expected[i] == live[i]) {
+				continue;
+			}
+
+			differ++;
+			if (run_start >= 0 && i - run_end < sizeof(struct verificator_diff_run)) {
+				run_end = i + 1;
+				continue;
+			}
+		}
+
+		/* A new run starts here, or the end flushes the last one */
+		if (run_start >= 0) {
+			struct verificator_diff_run run = {
+				.vdr_offset = run_start,
+				.vdr_length = run_end - run_start,
+			};
+			size_t need = VERIFICATOR_DIFF_RUN_SIZE(run.vdr_length);
+
+			if (used + need <= capacity) {
+				memcpy((char *)args->vrd_runs + used, &run, sizeof(run));
+				memcpy((char *)args->vrd_runs + used + sizeof(run),
+					live + run_start, run.vdr_length);
+			}
+			used += need;
+			count++;
+		}
+		run_start = i;
+		run_end = i + 1;
+	}
+
+	args->vrd_runs_size = used;
+	args->vrd_count = count;
+
+	return used > capacity ? -ENOSPC : (long)differ;
+}
+
+static long image_scan_region(struct verificator_region_scan_struct *args)
+{
+	const unsigned char 	*text;
+	struct timespec 	start, end;
+	unsigned int 		page_size = sysconf(_SC_PAGESIZE);
+	unsigned int 		*hashes;
+	unsigned int 		pages;
+	unsigned int 		mismatches = 0;
+	unsigned int 		i;
+
+	text = image_text(args->vrf_addr, args->vrf_size);
+	if (args->vrs_reserved != 0 || text == NULL) {
+		return -EINVAL;
+	}
+
+	pages = (args->vrf_size + page_size - 1) / page_size;
+	args->vrs_page_size = page_size;
+	if ((args->vrs_page_hashes || args->vrs_expected) && args->vrs_page_count < pages) {
+		args->vrs_page_count = pages;
+		return -ENOSPC;
+	}
+	args->vrs_page_count = pages;
+
+	hashes = args->vrs_page_hashes ? args->vrs_page_hashes : malloc(pages * sizeof(*hashes));
+	if (hashes == NULL) {
+		return -ENOMEM;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	args->vrs_root = block_hashes(text, args->vrf_size, page_size, hashes);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	args->vrs_cpus = 1;
+	args->vrs_nsec = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+			end.tv_nsec - start.tv_nsec;
+
+	for (i = 0; args->vrs_expected && i < pages; i++) {
+		if (args->vrs_expected[i] != hashes[i]) {
+			mismatches++;
+		}
+	}
+	args->vrs_mismatches = mismatches;
+
+	if (hashes != args->vrs_page_hashes) {
+		free(hashes);
+	}
+
+	return mismatches;
+}
+
+/* There is no scanner to hand the baseline to, it is only checked and counted */
+static long image_load_baseline(struct verificator_load_baseline_struct *args)
+{
+	unsigned int i;
+
+	if (args->vrl_count > VERIFICATOR_BATCH_MAX ||
+			(args->vrl_flags & ~VERIFICATOR_BASELINE_REPLACE)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < args->vrl_count; i++) {
+		const struct verificator_baseline_entry *entry = &args->vrl_entries[i];
+
+		if (image_text(entry->vrf_addr, entry->vrf_size) == NULL ||
+				entry->hash_algo >= VERIFICATOR_HASH_MAX) {
+			return -EINVAL;
+		}
+	}
+
+	pthread_mutex_lock(&image->restore_lock);
+	if (args->vrl_flags & VERIFICATOR_BASELINE_REPLACE) {
+		image->baseline_count = 0;
+	}
+	image->baseline_count += args->vrl_count;
+	i = image->baseline_count;
+	pthread_mutex_unlock(&image->restore_lock);
+
+	return i;
+}
+
+static long image_ioctl(unsigned long cmd, void *arg)
+{
+	switch (cmd) {
+		case VERIFICATOR_VERIFY_CODE:
+			return image_verify_code(arg);
+		case VERIFICATOR_GET_DIFF:
+			return image_get_diff(arg);
+		case VERIFICATOR_RESTORE:
+			return image_restore(arg);
+		case VERIFICATOR_VERIFY_BATCH:
+			return image_verify_batch(arg);
+		case VERIFICATOR_GET_BLOCK_HASHES:
+			return image_block_hashes(arg);
+		case VERIFICATOR_DIFF:
+			return image_diff(arg);
+		case VERIFICATOR_RESTORE_BATCH:
+			return image_restore_batch(arg);
+		case VERIFICATOR_SCAN_REGION:
+			return image_scan_region(arg);
+		case VERIFICATOR_LOAD_BASELINE:
+			return image_load_baseline(arg);
+		default:
+			return -EINVAL;
+	}
+}
+
+long verificator_backend_ioctl(int vfd, unsigned long cmd, void *arg)
+{
+	long ret;
+
+	if (image == NULL) {
+		return ioctl(vfd, cmd, arg);
+	}
+
+	ret = image_ioctl(cmd, arg);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
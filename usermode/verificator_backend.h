@@ -0,0 +1,40 @@
+#ifndef VERIFICATOR_BACKEND_H
+#define VERIFICATOR_BACKEND_H
+
+/*
+ * Where the verificator ioctls go. The kernel backend is the misc device;
+ * the file backend serves the same ioctls in userspace against a mapped
+ * image of kernel text, so everything above it runs unchanged on a box
+ * without the module. The backend is chosen with a spec:
+ *
+ *   kernel               /dev/verificator (default)
+ *   file:PATH[@BASE]     PATH holds the text starting at kernel address
+ *                        BASE, VERIFICATOR_IMAGE_BASE when omitted
+ *
+ * taken from --backend or, failing that, VERIFICATOR_BACKEND_ENV.
+ * Restores write through to PATH. The event ring (mmap/poll) needs the
+ * kernel backend.
+ */
+#define VERIFICATOR_BACKEND_ENV 	"VERIFICATOR_BACKEND"
+#define VERIFICATOR_IMAGE_BASE 		0xffffffff81000000UL
+
+/* Parses PATH[@BASE], path is a copy to free() */
+int verificator_image_spec(const char *spec, char **path, unsigned long *base);
+
+/* NULL spec selects the kernel backend. Call before any open */
+int verificator_backend_set(const char *spec);
+int verificator_backend_is_kernel(void);
+
+/*
+ * Bounds of section "text" (_stext.._etext) or "rodata" (__start_rodata..
+ * __end_rodata) for VERIFICATOR_SCAN_REGION: read from /proc/kallsyms on
+ * the kernel backend, the whole image stands in for text on the file one.
+ */
+int verificator_backend_section(const char *name, long *addr, size_t *size);
+
+/* Same contract as open(2), close(2) and ioctl(2): -1 and errno on error */
+int verificator_backend_open(const char *device);
+void verificator_backend_close(int vfd);
+long verificator_backend_ioctl(int vfd, unsigned long cmd, void *arg);
+
+#endif
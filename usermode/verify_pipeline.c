@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <verificator.h>
+#include "hash.h"
+#include "verify_pipeline.h"
+#include "verificator_backend.h"
+
+/* Rows handed to the ioctl workers at once */
+#define PIPELINE_BATCH 		256
+#define PIPELINE_QUEUE_SIZE 	4096
+
+struct verify_job {
+	char 			*name;
+	unsigned char 		*code; 		/* NULL when the stored hash is used */
+	struct verificator_verify_entry ve;
+};
+
+/* Bounded multi-producer multi-consumer queue of jobs */
+struct job_queue {
+	struct verify_job 	*items[PIPELINE_QUEUE_SIZE];
+	unsigned int 		head;
+	unsigned int 		count;
+	bool 			closed;
+	pthread_mutex_t 	lock;
+	pthread_cond_t 		not_empty;
+	pthread_cond_t 		not_full;
+};
+
+static void queue_init(struct job_queue *q)
+{
+	q->head = q->count = 0;
+	q->closed = false;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(struct job_queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+}
+
+static void queue_push(struct job_queue *q, struct verify_job *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == PIPELINE_QUEUE_SIZE) {
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->items[(q->head + q->count++) % PIPELINE_QUEUE_SIZE] = job;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes up to max jobs, waiting for the first one; 0 once closed and drained */
+static unsigned int queue_pop(struct job_queue *q, struct verify_job **jobs, unsigned int max)
+{
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed) {
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	while (n < max && q->count) {
+		jobs[n++] = q->items[q->head];
+		q->head = (q->head + 1) % PIPELINE_QUEUE_SIZE;
+		q->count--;
+	}
+	if (n) {
+		pthread_cond_broadcast(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return n;
+}
+
+static void queue_close(struct job_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+struct verify_pipeline {
+	const char 		*device;
+	unsigned int 		jobs;
+	int 			hash_algo_override;
+
+	struct job_queue 	rows; 		/* reader -> hash workers */
+	struct job_queue 	verify; 	/* hash workers -> ioctl workers */
+	unsigned int 		hashers_left;
+
+	pthread_t 		*threads;
+	unsigned int 		nthreads;
+
+	/* Report, under report_lock */
+	pthread_mutex_t 	report_lock;
+	struct verify_job 	**failed;
+	unsigned int 		nfailed;
+	unsigned int 		failed_capacity;
+	unsigned long 		verified;
+	long 			mismatches;
+	bool 			error;
+
+	struct timespec 	start;
+};
+
+static void job_free(struct verify_job *job)
+{
+	free(job->name);
+	free(job->code);
+	free(job);
+}
+
+static void *hash_worker(void *arg)
+{
+	struct verify_pipeline 	*p = arg;
+	struct verify_job 	*jobs[PIPELINE_BATCH];
+	unsigned int 		n, i;
+
+	while ((n = queue_pop(&p->rows, jobs, PIPELINE_BATCH)) != 0) {
+		for (i = 0; i < n; i++) {
+			struct verify_job *job = jobs[i];
+
+			if (job->code) {
+				job->ve.hash = verificator_hash(job->ve.hash_algo, job->code,
+								job->ve.vrf_size);
+				free(job->code);
+				job->code = NULL;
+			}
+			queue_push(&p->verify, job);
+		}
+	}
+
+	if (__atomic_sub_fetch(&p->hashers_left, 1, __ATOMIC_ACQ_REL) == 0) {
+		queue_close(&p->verify);
+	}
+
+	return NULL;
+}
+
+static void report_batch(struct verify_pipeline *p, struct verify_job **jobs, unsigned int n,
+			long ret)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&p->report_lock);
+
+	if (ret < 0) {
+		p->error = true;
+	} else {
+		p->mismatches += ret;
+	}
+	p->verified += n;
+
+	for (i = 0; i < n; i++) {
+		if (ret >= 0 && jobs[i]->ve.vrf_result == 0) {
+			job_free(jobs[i]);
+			continue;
+		}
+
+		if (p->nfailed == p->failed_capacity) {
+			unsigned int capacity = p->failed_capacity ? p->failed_capacity * 2 : 64;
+			void *failed = realloc(p->failed, capacity * sizeof(*p->failed));
+
+			if (failed == NULL) {
+				job_free(jobs[i]);
+				continue;
+			}
+			p->failed = failed;
+			p->failed_capacity = capacity;
+		}
+		if (ret < 0) {
+			jobs[i]->ve.vrf_result = ret;
+		}
+		p->failed[p->nfailed++] = jobs[i];
+	}
+
+	pthread_mutex_unlock(&p->report_lock);
+}
+
+static void *ioctl_worker(void *arg)
+{
+	struct verify_pipeline 		*p = arg;
+	struct verify_job 		*jobs[PIPELINE_BATCH];
+	struct verificator_verify_entry entries[PIPELINE_BATCH];
+	unsigned int 			n, i;
+	long 				open_err = 0;
+	int 				vfd;
+
+	vfd = verificator_backend_open(p->device);
+	if (vfd < 0) {
+		open_err = -errno;
+		perror(p->device);
+	}
+
+	while ((n = queue_pop(&p->verify, jobs, PIPELINE_BATCH)) != 0) {
+		struct verificator_verify_batch_struct batch = {
+			.vrb_count = n,
+			.vrb_entries = entries,
+		};
+		long ret = open_err;
+
+		for (i = 0; i < n; i++) {
+			entries[i] = jobs[i]->ve;
+		}
+
+		if (vfd >= 0) {
+			ret = verificator_backend_ioctl(vfd, VERIFICATOR_VERIFY_BATCH, &batch);
+			if (ret < 0) {
+				ret = -errno;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			jobs[i]->ve = entries[i];
+		}
+		report_batch(p, jobs, n, ret);
+	}
+
+	if (vfd >= 0) {
+		verificator_backend_close(vfd);
+	}
+	return NULL;
+}
+
+struct verify_pipeline *verify_pipeline_start(const char *device, unsigned int jobs,
+						int hash_algo_override)
+{
+	struct verify_pipeline *p;
+	unsigned int ioctl_workers = 0;
+	unsigned int i;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->device = device;
+	p->jobs = jobs ? jobs : 1;
+	p->hash_algo_override = hash_algo_override;
+	p->hashers_left = p->jobs;
+	queue_init(&p->rows);
+	queue_init(&p->verify);
+	pthread_mutex_init(&p->report_lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+
+	p->threads = calloc(2 * p->jobs, sizeof(*p->threads));
+	if (p->threads == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	for (i = 0; i < p->jobs; i++) {
+		if (pthread_create(&p->threads[p->nthreads], NULL, hash_worker, p) == 0) {
+			p->nthreads++;
+		} else {
+			__atomic_sub_fetch(&p->hashers_left, 1, __ATOMIC_ACQ_REL);
+		}
+	}
+	for (i = 0; i < p->jobs; i++) {
+		if (pthread_create(&p->threads[p->nthreads], NULL, ioctl_worker, p) == 0) {
+			p->nthreads++;
+			ioctl_workers++;
+		}
+	}
+
+	if (ioctl_workers == 0) {
+		fprintf(stderr, "Cannot start pipeline threads\n");
+		verify_pipeline_finish(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+/* Reader stage: copies what the row holds, the statement is reused next */
+int verify_pipeline_push(void *ctx, struct verification_entry *entry)
+{
+	struct verify_pipeline 	*p = ctx;
+	struct verify_job 	*job;
+	unsigned int 		algo;
+
+	algo = p->hash_algo_override >= 0 ? p->hash_algo_override : entry->hash_algo;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		fprintf(stderr, "Cannot alloc memory for pipeline\n");
+		return -1;
+	}
+
+	job->name = strdup(entry->name ? entry->name : "?");
+	job->ve.vrf_addr = entry->addr;
+	job->ve.vrf_size = entry->size;
+	job->ve.hash_algo = algo;
+
+	if (entry->has_hash && entry->hash_algo == algo) {
+		job->ve.hash = entry->hash;
+	} else {
+		job->code = malloc(entry->size);
+		if (job->code == NULL) {
+			fprintf(stderr, "Cannot alloc memory for pipeline\n");
+			job_free(job);
+			return -1;
+		}
+		memcpy(job->code, entry->code, entry->size);
+	}
+
+	queue_push(&p->rows, job);
+	return 0;
+}
+
+static int failed_cmp(const void *a, const void *b)
+{
+	const struct verify_job *l = *(struct verify_job * const *)a;
+	const struct verify_job *r = *(struct verify_job * const *)b;
+
+	return (unsigned long)l->ve.vrf_addr < (unsigned long)r->ve.vrf_addr ? -1 :
+		(unsigned long)l->ve.vrf_addr > (unsigned long)r->ve.vrf_addr;
+}
+
+long verify_pipeline_finish(struct verify_pipeline *p)
+{
+	struct timespec end;
+	unsigned int 	i;
+	long 		ret;
+
+	queue_close(&p->rows);
+	/* Without any hash worker nothing would ever close the verify queue */
+	if (p->hashers_left == 0) {
+		queue_close(&p->verify);
+	}
+	for (i = 0; i < p->nthreads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	qsort(p->failed, p->nfailed, sizeof(*p->failed), failed_cmp);
+	for (i = 0; i < p->nfailed; i++) {
+		struct verificator_verify_entry *ve = &p->failed[i]->ve;
+
+		if (ve->vrf_result < 0) {
+			printf("%s [%p]: error %ld\n", p->failed[i]->name,
+					(void *)ve->vrf_addr, ve->vrf_result);
+		} else {
+			printf("%s [%p]: %s expected [%llx] gotted [%llx]\n",
+					p->failed[i]->name, (void *)ve->vrf_addr,
+					hash_algo_name(ve->hash_algo), ve->hash, ve->vrf_actual);
+		}
+		job_free(p->failed[i]);
+	}
+
+	printf("Verified %lu functions, %ld mismatches, %u jobs in %.3f ms\n",
+		p->verified, p->mismatches, p->jobs,
+		(end.tv_sec - p->start.tv_sec) * 1e3 + (end.tv_nsec - p->start.tv_nsec) / 1e6);
+
+	ret = p->error ? -1 : p->mismatches;
+
+	queue_destroy(&p->rows);
+	queue_destroy(&p->verify);
+	pthread_mutex_destroy(&p->report_lock);
+	free(p->failed);
+	free(p->threads);
+	free(p);
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef VERIFICATOR_VERIFY_PIPELINE_H
+#define VERIFICATOR_VERIFY_PIPELINE_H
+
+#include "baseline_db.h"
+
+/*
+ * Multi-threaded verification: the caller feeds baseline rows in with
+ * verify_pipeline_push() (a verification_entry_cb), hash workers compute
+ * the expected digests and ioctl workers, each on its own device fd,
+ * verify them in batches. verify_pipeline_finish() waits for the rest and
+ * prints one report sorted by address.
+ */
+struct verify_pipeline;
+
+struct verify_pipeline *verify_pipeline_start(const char *device, unsigned int jobs,
+						int hash_algo_override);
+int verify_pipeline_push(void *ctx, struct verification_entry *entry);
+
+/* Returns the number of mismatches, or -1 when verification failed */
+long verify_pipeline_finish(struct verify_pipeline *pipeline);
+
+#endif